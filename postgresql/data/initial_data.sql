@@ -9,25 +9,27 @@
 -- Data for Name: system_items; Type: TABLE DATA; Schema: yet_another_disk; Owner: postgres
 --
 
-INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, parent_string) VALUES ('97ce575d-bcc4-5778-8535-6947d809d5a1', '/file/url1                                                                                                                                                                                                                                                     ', 'c97045e0-7da3-5979-a17a-be062235c07b', 'FILE                                                                                                                                                                                                                                                           ', 128, '2022-02-02 15:00:00+03', '863e1a7a-1304-42ae-943b-179184c077e3                                                                                                                                                                                                                           ', 'd515e43f-f3f6-4471-bb77-6b455017a2d2                                                                                                                                                                                                                           ');
-INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, parent_string) VALUES ('bb0bf9d8-3086-5801-b17e-1827333eb5ef', '/file/url3                                                                                                                                                                                                                                                     ', 'a549054b-4980-55ea-bed4-939945dd0993', 'FILE                                                                                                                                                                                                                                                           ', 512, '2022-02-03 15:00:00+03', '98883e8f-0507-482f-bce2-2fb306cf6483                                                                                                                                                                                                                           ', '1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2                                                                                                                                                                                                                           ');
-INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, parent_string) VALUES ('59913966-3ed9-5aee-8044-a1f14f06cf77', NULL, NULL, 'FOLDER                                                                                                                                                                                                                                                         ', 1984, '2022-02-03 18:00:00+03', '069cb8d7-bbdd-47d3-ad8f-82ef4c269df1                                                                                                                                                                                                                           ', NULL);
-INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, parent_string) VALUES ('d4f2e0d1-4a61-5955-ad40-4cb509cb65f0', '/file/url2                                                                                                                                                                                                                                                     ', 'c97045e0-7da3-5979-a17a-be062235c07b', 'FILE                                                                                                                                                                                                                                                           ', 256, '2022-02-02 15:00:00+03', 'b1d8fd7d-2ae3-47d5-b2f9-0f094af800d4                                                                                                                                                                                                                           ', 'd515e43f-f3f6-4471-bb77-6b455017a2d2                                                                                                                                                                                                                           ');
-INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, parent_string) VALUES ('c97045e0-7da3-5979-a17a-be062235c07b', NULL, '59913966-3ed9-5aee-8044-a1f14f06cf77', 'FOLDER                                                                                                                                                                                                                                                         ', 384, '2022-02-02 15:00:00+03', 'd515e43f-f3f6-4471-bb77-6b455017a2d2                                                                                                                                                                                                                           ', '069cb8d7-bbdd-47d3-ad8f-82ef4c269df1                                                                                                                                                                                                                           ');
-INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, parent_string) VALUES ('267f1d13-66ac-51fc-98c3-cc88f90b8a8e', '/file/url4                                                                                                                                                                                                                                                     ', 'a549054b-4980-55ea-bed4-939945dd0993', 'FILE                                                                                                                                                                                                                                                           ', 1024, '2022-02-03 15:00:00+03', '74b81fda-9cdc-4b63-8927-c978afed5cf4                                                                                                                                                                                                                           ', '1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2                                                                                                                                                                                                                           ');
-INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, parent_string) VALUES ('6ff729ee-6181-561b-b684-225fe6c2b077', '/file/url5                                                                                                                                                                                                                                                     ', 'a549054b-4980-55ea-bed4-939945dd0993', 'FILE                                                                                                                                                                                                                                                           ', 64, '2022-02-03 18:00:00+03', '73bc3b36-02d1-4245-ab35-3106c9ee1c65                                                                                                                                                                                                                           ', '1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2                                                                                                                                                                                                                           ');
-INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, parent_string) VALUES ('a549054b-4980-55ea-bed4-939945dd0993', NULL, '59913966-3ed9-5aee-8044-a1f14f06cf77', 'FOLDER                                                                                                                                                                                                                                                         ', 1600, '2022-02-03 18:00:00+03', '1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2                                                                                                                                                                                                                           ', '069cb8d7-bbdd-47d3-ad8f-82ef4c269df1                                                                                                                                                                                                                           ');
+INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, path, file_count, max_depth, last_modified) VALUES ('97ce575d-bcc4-5778-8535-6947d809d5a1', '/file/url1', 'c97045e0-7da3-5979-a17a-be062235c07b', 'FILE', 128, '2022-02-02 15:00:00+03', '863e1a7a-1304-42ae-943b-179184c077e3', '{59913966-3ed9-5aee-8044-a1f14f06cf77,c97045e0-7da3-5979-a17a-be062235c07b,97ce575d-bcc4-5778-8535-6947d809d5a1}', 1, 0, '2022-02-02 15:00:00+03');
+INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, path, file_count, max_depth, last_modified) VALUES ('bb0bf9d8-3086-5801-b17e-1827333eb5ef', '/file/url3', 'a549054b-4980-55ea-bed4-939945dd0993', 'FILE', 512, '2022-02-03 15:00:00+03', '98883e8f-0507-482f-bce2-2fb306cf6483', '{59913966-3ed9-5aee-8044-a1f14f06cf77,a549054b-4980-55ea-bed4-939945dd0993,bb0bf9d8-3086-5801-b17e-1827333eb5ef}', 1, 0, '2022-02-03 15:00:00+03');
+INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, path, file_count, max_depth, last_modified) VALUES ('59913966-3ed9-5aee-8044-a1f14f06cf77', NULL, NULL, 'FOLDER', 1984, '2022-02-03 18:00:00+03', '069cb8d7-bbdd-47d3-ad8f-82ef4c269df1', '{59913966-3ed9-5aee-8044-a1f14f06cf77}', 5, 2, '2022-02-03 18:00:00+03');
+INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, path, file_count, max_depth, last_modified) VALUES ('d4f2e0d1-4a61-5955-ad40-4cb509cb65f0', '/file/url2', 'c97045e0-7da3-5979-a17a-be062235c07b', 'FILE', 256, '2022-02-02 15:00:00+03', 'b1d8fd7d-2ae3-47d5-b2f9-0f094af800d4', '{59913966-3ed9-5aee-8044-a1f14f06cf77,c97045e0-7da3-5979-a17a-be062235c07b,d4f2e0d1-4a61-5955-ad40-4cb509cb65f0}', 1, 0, '2022-02-02 15:00:00+03');
+INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, path, file_count, max_depth, last_modified) VALUES ('c97045e0-7da3-5979-a17a-be062235c07b', NULL, '59913966-3ed9-5aee-8044-a1f14f06cf77', 'FOLDER', 384, '2022-02-02 15:00:00+03', 'd515e43f-f3f6-4471-bb77-6b455017a2d2', '{59913966-3ed9-5aee-8044-a1f14f06cf77,c97045e0-7da3-5979-a17a-be062235c07b}', 2, 1, '2022-02-02 15:00:00+03');
+INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, path, file_count, max_depth, last_modified) VALUES ('267f1d13-66ac-51fc-98c3-cc88f90b8a8e', '/file/url4', 'a549054b-4980-55ea-bed4-939945dd0993', 'FILE', 1024, '2022-02-03 15:00:00+03', '74b81fda-9cdc-4b63-8927-c978afed5cf4', '{59913966-3ed9-5aee-8044-a1f14f06cf77,a549054b-4980-55ea-bed4-939945dd0993,267f1d13-66ac-51fc-98c3-cc88f90b8a8e}', 1, 0, '2022-02-03 15:00:00+03');
+INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, path, file_count, max_depth, last_modified) VALUES ('6ff729ee-6181-561b-b684-225fe6c2b077', '/file/url5', 'a549054b-4980-55ea-bed4-939945dd0993', 'FILE', 64, '2022-02-03 18:00:00+03', '73bc3b36-02d1-4245-ab35-3106c9ee1c65', '{59913966-3ed9-5aee-8044-a1f14f06cf77,a549054b-4980-55ea-bed4-939945dd0993,6ff729ee-6181-561b-b684-225fe6c2b077}', 1, 0, '2022-02-03 18:00:00+03');
+INSERT INTO yet_another_disk.system_items (id, url, parent_id, item_type, item_size, "date-time", id_string, path, file_count, max_depth, last_modified) VALUES ('a549054b-4980-55ea-bed4-939945dd0993', NULL, '59913966-3ed9-5aee-8044-a1f14f06cf77', 'FOLDER', 1600, '2022-02-03 18:00:00+03', '1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2', '{59913966-3ed9-5aee-8044-a1f14f06cf77,a549054b-4980-55ea-bed4-939945dd0993}', 3, 1, '2022-02-03 18:00:00+03');
 
 
 --
 -- Data for Name: history; Type: TABLE DATA; Schema: yet_another_disk; Owner: postgres
 --
 
-INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url) VALUES ('97ce575d-bcc4-5778-8535-6947d809d5a1', '2022-02-02 15:00:00+03', 'c97045e0-7da3-5979-a17a-be062235c07b', NULL, '/file/url1                                                                                                                                                                                                                                                     ');
-INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url) VALUES ('d4f2e0d1-4a61-5955-ad40-4cb509cb65f0', '2022-02-02 15:00:00+03', 'c97045e0-7da3-5979-a17a-be062235c07b', NULL, '/file/url2                                                                                                                                                                                                                                                     ');
-INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url) VALUES ('bb0bf9d8-3086-5801-b17e-1827333eb5ef', '2022-02-03 15:00:00+03', 'a549054b-4980-55ea-bed4-939945dd0993', NULL, '/file/url3                                                                                                                                                                                                                                                     ');
-INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url) VALUES ('267f1d13-66ac-51fc-98c3-cc88f90b8a8e', '2022-02-03 15:00:00+03', 'a549054b-4980-55ea-bed4-939945dd0993', NULL, '/file/url4                                                                                                                                                                                                                                                     ');
-INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url) VALUES ('6ff729ee-6181-561b-b684-225fe6c2b077', '2022-02-03 18:00:00+03', 'a549054b-4980-55ea-bed4-939945dd0993', NULL, '/file/url5                                                                                                                                                                                                                                                     ');
+SELECT yet_another_disk.create_history_partition('2022-02-01 00:00:00+00');
+
+INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url, id_string, parent_string, item_type) VALUES ('97ce575d-bcc4-5778-8535-6947d809d5a1', '2022-02-02 15:00:00+03', 'c97045e0-7da3-5979-a17a-be062235c07b', 128, '/file/url1', '863e1a7a-1304-42ae-943b-179184c077e3', 'd515e43f-f3f6-4471-bb77-6b455017a2d2', 'FILE');
+INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url, id_string, parent_string, item_type) VALUES ('d4f2e0d1-4a61-5955-ad40-4cb509cb65f0', '2022-02-02 15:00:00+03', 'c97045e0-7da3-5979-a17a-be062235c07b', 256, '/file/url2', 'b1d8fd7d-2ae3-47d5-b2f9-0f094af800d4', 'd515e43f-f3f6-4471-bb77-6b455017a2d2', 'FILE');
+INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url, id_string, parent_string, item_type) VALUES ('bb0bf9d8-3086-5801-b17e-1827333eb5ef', '2022-02-03 15:00:00+03', 'a549054b-4980-55ea-bed4-939945dd0993', 512, '/file/url3', '98883e8f-0507-482f-bce2-2fb306cf6483', '1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2', 'FILE');
+INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url, id_string, parent_string, item_type) VALUES ('267f1d13-66ac-51fc-98c3-cc88f90b8a8e', '2022-02-03 15:00:00+03', 'a549054b-4980-55ea-bed4-939945dd0993', 1024, '/file/url4', '74b81fda-9cdc-4b63-8927-c978afed5cf4', '1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2', 'FILE');
+INSERT INTO yet_another_disk.history (item_id, "date-time", parent_id, item_size, url, id_string, parent_string, item_type) VALUES ('6ff729ee-6181-561b-b684-225fe6c2b077', '2022-02-03 18:00:00+03', 'a549054b-4980-55ea-bed4-939945dd0993', 64, '/file/url5', '73bc3b36-02d1-4245-ab35-3106c9ee1c65', '1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2', 'FILE');
 
 
 --
@@ -0,0 +1,36 @@
+-- Adds the materialized path of every item, the ids from the root down to
+-- the item itself, and fills it in by walking parent_id from the roots.
+-- Items whose parent is missing are treated as roots. The backfill rewrites
+-- system_items once, run it while imports are stopped.
+
+BEGIN;
+
+ALTER TABLE yet_another_disk.system_items
+    ADD COLUMN path uuid[];
+
+WITH RECURSIVE paths AS (
+    SELECT s.id, ARRAY[s.id] AS path
+    FROM yet_another_disk.system_items s
+    WHERE s.parent_id IS NULL
+       OR NOT EXISTS (SELECT 1 FROM yet_another_disk.system_items p WHERE p.id = s.parent_id)
+    UNION ALL
+    SELECT c.id, p.path || c.id
+    FROM yet_another_disk.system_items c
+        JOIN paths p ON c.parent_id = p.id
+)
+UPDATE yet_another_disk.system_items s
+    SET path = p.path
+    FROM paths p
+    WHERE s.id = p.id;
+
+-- Only a parent_id cycle is left without a path, and it has no root to be
+-- reached from. Fails here rather than leaving the column nullable.
+ALTER TABLE yet_another_disk.system_items
+    ALTER COLUMN path SET NOT NULL;
+
+CREATE INDEX idx_system_items_path ON yet_another_disk.system_items USING gin ( path );
+CREATE INDEX idx_system_items_parent_id ON yet_another_disk.system_items ( parent_id );
+
+COMMIT;
+
+ANALYZE yet_another_disk.system_items;
@@ -0,0 +1,6 @@
+-- Pages of children are read in id order, the index on (parent_id, id)
+-- serves them without a sort and replaces the one on parent_id alone.
+
+CREATE INDEX CONCURRENTLY idx_system_items_parent_id_id ON yet_another_disk.system_items ( parent_id, id );
+DROP INDEX CONCURRENTLY yet_another_disk.idx_system_items_parent_id;
+ALTER INDEX yet_another_disk.idx_system_items_parent_id_id RENAME TO idx_system_items_parent_id;
@@ -0,0 +1,22 @@
+-- History rows carry the size and the string ids of the item and its
+-- parent, so /updates is a range scan of the "date-time" index that never
+-- reads system_items. Existing rows get the ids the items have now.
+
+BEGIN;
+
+ALTER TABLE yet_another_disk.history
+    ADD COLUMN id_string text,
+    ADD COLUMN parent_string text;
+
+UPDATE yet_another_disk.history h
+    SET id_string = rtrim(s.id_string),
+        parent_string = rtrim(p.id_string)
+    FROM yet_another_disk.system_items s
+        LEFT JOIN yet_another_disk.system_items p ON p.id = s.parent_id
+    WHERE s.id = h.item_id;
+
+CREATE INDEX idx_history_date_time ON yet_another_disk.history ( "date-time" );
+
+COMMIT;
+
+ANALYZE yet_another_disk.history;
@@ -0,0 +1,96 @@
+-- Converts an unpartitioned history table into the one partitioned by
+-- month, with a default partition for rows outside every month that has a
+-- partition. Rows without a date cannot be placed in a partition and are
+-- dropped, item_type is taken from the item. Copies the whole table, run it
+-- while imports are stopped.
+
+BEGIN;
+
+ALTER TABLE yet_another_disk.history RENAME TO history_unpartitioned;
+ALTER INDEX IF EXISTS yet_another_disk.idx_history_date_time RENAME TO idx_history_unpartitioned_date_time;
+
+CREATE TABLE yet_another_disk.history (
+    item_id       uuid NOT NULL,
+    "date-time"   timestamptz NOT NULL,
+    parent_id     uuid,
+    item_size     bigint,
+    url           text,
+    id_string     text,
+    parent_string text,
+    item_type     text,
+    CONSTRAINT fk_history_system_items FOREIGN KEY ( item_id ) REFERENCES yet_another_disk.system_items( id ) ON DELETE CASCADE
+) PARTITION BY RANGE ( "date-time" );
+
+CREATE INDEX idx_history_date_time ON yet_another_disk.history ( "date-time" );
+CREATE INDEX idx_history_item_id ON yet_another_disk.history ( item_id, "date-time" );
+
+CREATE TABLE yet_another_disk.history_default PARTITION OF yet_another_disk.history DEFAULT;
+
+CREATE FUNCTION yet_another_disk.create_history_partition(at timestamptz) RETURNS void AS $$
+DECLARE
+    month_start timestamptz := date_trunc('month', at AT TIME ZONE 'UTC') AT TIME ZONE 'UTC';
+    month_end timestamptz := month_start + interval '1 month';
+    partition_name text := 'history_' || to_char(month_start AT TIME ZONE 'UTC', 'YYYY_MM');
+BEGIN
+    PERFORM pg_advisory_xact_lock(hashtext('yet_another_disk.history'));
+    IF to_regclass('yet_another_disk.' || partition_name) IS NOT NULL THEN
+        RETURN;
+    END IF;
+    EXECUTE format('CREATE TABLE yet_another_disk.%I (LIKE yet_another_disk.history INCLUDING DEFAULTS)',
+                   partition_name);
+    EXECUTE format('WITH moved AS (DELETE FROM yet_another_disk.history_default'
+                   ' WHERE "date-time" >= %L AND "date-time" < %L RETURNING *)'
+                   ' INSERT INTO yet_another_disk.%I SELECT * FROM moved',
+                   month_start, month_end, partition_name);
+    EXECUTE format('ALTER TABLE yet_another_disk.history ATTACH PARTITION yet_another_disk.%I'
+                   ' FOR VALUES FROM (%L) TO (%L)',
+                   partition_name, month_start, month_end);
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION yet_another_disk.drop_history_partitions(cutoff timestamptz) RETURNS integer AS $$
+DECLARE
+    partition_name text;
+    dropped integer := 0;
+BEGIN
+    FOR partition_name IN
+        SELECT c.relname
+        FROM pg_inherits i
+            JOIN pg_class c ON c.oid = i.inhrelid
+        WHERE i.inhparent = 'yet_another_disk.history'::regclass
+          AND c.relname ~ '^history_[0-9]{4}_[0-9]{2}$'
+          AND to_date(substring(c.relname FROM 9), 'YYYY_MM') + interval '1 month'
+                  <= cutoff AT TIME ZONE 'UTC'
+    LOOP
+        EXECUTE format('DROP TABLE yet_another_disk.%I', partition_name);
+        dropped := dropped + 1;
+    END LOOP;
+    DELETE FROM yet_another_disk.history_default WHERE "date-time" < cutoff;
+    RETURN dropped;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Every month that has history gets its partition, as do the coming ones
+-- that HistoryRetention would otherwise create on its first run.
+SELECT yet_another_disk.create_history_partition(m)
+FROM (
+    SELECT DISTINCT date_trunc('month', "date-time" AT TIME ZONE 'UTC') AT TIME ZONE 'UTC' AS m
+    FROM yet_another_disk.history_unpartitioned
+    WHERE "date-time" IS NOT NULL
+    UNION
+    SELECT now() + n * interval '1 month' FROM generate_series(0, 3) n
+) months;
+
+INSERT INTO yet_another_disk.history
+    (item_id, "date-time", parent_id, item_size, url, id_string, parent_string, item_type)
+SELECT h.item_id, h."date-time", h.parent_id, h.item_size, rtrim(h.url), h.id_string, h.parent_string,
+       rtrim(s.item_type::text)
+FROM yet_another_disk.history_unpartitioned h
+    JOIN yet_another_disk.system_items s ON s.id = h.item_id
+WHERE h."date-time" IS NOT NULL;
+
+DROP TABLE yet_another_disk.history_unpartitioned;
+
+COMMIT;
+
+ANALYZE yet_another_disk.history;
@@ -0,0 +1,19 @@
+-- Adds the folders SizeReconciler has to check and marks every existing
+-- folder, so that the first passes check the whole tree once.
+
+BEGIN;
+
+CREATE TABLE yet_another_disk.dirty_folders (
+    id    uuid NOT NULL,
+    depth integer NOT NULL,
+    CONSTRAINT pk_dirty_folders PRIMARY KEY ( id )
+);
+
+CREATE INDEX idx_dirty_folders_depth ON yet_another_disk.dirty_folders ( depth, id );
+
+INSERT INTO yet_another_disk.dirty_folders (id, depth)
+SELECT id, array_length(path, 1)
+FROM yet_another_disk.system_items
+WHERE rtrim(item_type) = 'FOLDER';
+
+COMMIT;
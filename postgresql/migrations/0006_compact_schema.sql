@@ -0,0 +1,30 @@
+-- Moves an existing database to the compact system_items layout: text
+-- instead of padded char(255), an enum for the item type and no copy of
+-- the parent's string id. Changing the column types rewrites system_items
+-- and history once, run it while imports are stopped.
+
+BEGIN;
+
+CREATE TYPE yet_another_disk.item_type AS ENUM ( 'FILE', 'FOLDER' );
+
+ALTER TABLE yet_another_disk.system_items
+    ALTER COLUMN url TYPE text USING rtrim(url),
+    ALTER COLUMN id_string TYPE text USING rtrim(id_string),
+    ALTER COLUMN item_type TYPE yet_another_disk.item_type
+        USING rtrim(item_type)::yet_another_disk.item_type,
+    DROP COLUMN parent_string;
+
+UPDATE yet_another_disk.system_items SET item_size = 0 WHERE item_size IS NULL;
+
+ALTER TABLE yet_another_disk.system_items
+    ALTER COLUMN item_type SET NOT NULL,
+    ALTER COLUMN item_size SET NOT NULL,
+    ALTER COLUMN id_string SET NOT NULL;
+
+ALTER TABLE yet_another_disk.history
+    ALTER COLUMN item_type TYPE yet_another_disk.item_type
+        USING item_type::yet_another_disk.item_type;
+
+COMMIT;
+
+ANALYZE yet_another_disk.system_items;
@@ -0,0 +1,29 @@
+-- Adds the per-subtree file count, depth and last change to system_items
+-- and fills them in from the materialized paths. The backfill reads every
+-- subtree once, run it while imports are stopped.
+
+BEGIN;
+
+ALTER TABLE yet_another_disk.system_items
+    ADD COLUMN file_count bigint DEFAULT 0 NOT NULL,
+    ADD COLUMN max_depth integer DEFAULT 0 NOT NULL,
+    ADD COLUMN last_modified timestamptz;
+
+UPDATE yet_another_disk.system_items s
+    SET file_count = a.files,
+        max_depth = a.max_depth,
+        last_modified = a.last_modified
+    FROM (
+        SELECT i.id,
+               count(*) FILTER (WHERE d.item_type = 'FILE') AS files,
+               max(array_length(d.path, 1)) - array_length(i.path, 1) AS max_depth,
+               max(d."date-time") AS last_modified
+        FROM yet_another_disk.system_items i
+            JOIN yet_another_disk.system_items d ON d.path @> ARRAY[i.id]
+        GROUP BY i.id, i.path
+    ) a
+    WHERE s.id = a.id;
+
+COMMIT;
+
+ANALYZE yet_another_disk.system_items;
@@ -0,0 +1,31 @@
+-- Lets TreeCache update incrementally: changed_at marks the last write to
+-- every row and deleted_items records the roots of deleted subtrees.
+-- Existing rows get the migration time as changed_at, a full reload picks
+-- them up anyway.
+
+BEGIN;
+
+ALTER TABLE yet_another_disk.system_items
+    ADD COLUMN changed_at timestamptz DEFAULT now() NOT NULL;
+
+CREATE INDEX idx_system_items_changed_at ON yet_another_disk.system_items ( changed_at );
+
+CREATE FUNCTION yet_another_disk.touch_system_item() RETURNS trigger AS $$
+BEGIN
+    NEW.changed_at := now();
+    RETURN NEW;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER trg_system_items_changed_at BEFORE UPDATE ON yet_another_disk.system_items
+    FOR EACH ROW EXECUTE FUNCTION yet_another_disk.touch_system_item();
+
+CREATE TABLE yet_another_disk.deleted_items (
+    id         uuid NOT NULL,
+    deleted_at timestamptz DEFAULT now() NOT NULL,
+    CONSTRAINT pk_deleted_items PRIMARY KEY ( id )
+);
+
+CREATE INDEX idx_deleted_items_deleted_at ON yet_another_disk.deleted_items ( deleted_at );
+
+COMMIT;
@@ -1,23 +1,141 @@
 DROP SCHEMA IF EXISTS yet_another_disk CASCADE;
 CREATE SCHEMA IF NOT EXISTS yet_another_disk;
 
+CREATE TYPE yet_another_disk.item_type AS ENUM ( 'FILE', 'FOLDER' );
+
+-- id_string is the id as the client sent it, id is the uuid derived from it.
+-- The parent's string id is not repeated here, it is joined in by parent_id.
+-- Like item_size, file_count (1 for a file), max_depth (levels down to the
+-- deepest descendant) and last_modified (latest change in the subtree) are
+-- aggregates over the subtree kept up to date by every write.
 CREATE  TABLE yet_another_disk.system_items (
                                                 id                   uuid  NOT NULL  ,
-                                                url                  char(255)    ,
+                                                url                  text    ,
                                                 parent_id            uuid    ,
-                                                item_type            char(255)    ,
-                                                item_size            bigint    ,
+                                                item_type            yet_another_disk.item_type  NOT NULL  ,
+                                                item_size            bigint  NOT NULL  ,
                                                 "date-time"          timestamptz    ,
-                                                id_string            char(255)    ,
-                                                parent_string        char(255)    ,
+                                                id_string            text  NOT NULL  ,
+                                                path                 uuid[]  NOT NULL  ,
+                                                file_count           bigint  DEFAULT 0 NOT NULL  ,
+                                                max_depth            integer  DEFAULT 0 NOT NULL  ,
+                                                last_modified        timestamptz    ,
+                                                changed_at           timestamptz  DEFAULT now() NOT NULL  ,
                                                 CONSTRAINT pk_system_items PRIMARY KEY ( id )
 );
 
+-- path holds the ids from the root down to the item itself, so subtree
+-- and ancestor lookups are single indexed queries instead of recursive walks.
+CREATE INDEX idx_system_items_path ON yet_another_disk.system_items USING gin ( path );
+CREATE INDEX idx_system_items_parent_id ON yet_another_disk.system_items ( parent_id, id );
+
+-- changed_at is the server time of the last write to the row, whatever the
+-- client's dates are. TreeCache reads the rows changed since its previous
+-- update instead of the whole table.
+CREATE INDEX idx_system_items_changed_at ON yet_another_disk.system_items ( changed_at );
+
+CREATE FUNCTION yet_another_disk.touch_system_item() RETURNS trigger AS $$
+BEGIN
+    NEW.changed_at := now();
+    RETURN NEW;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER trg_system_items_changed_at BEFORE UPDATE ON yet_another_disk.system_items
+    FOR EACH ROW EXECUTE FUNCTION yet_another_disk.touch_system_item();
+
+-- Roots of deleted subtrees, so that incremental TreeCache updates see
+-- deletes too. Rows older than a full cache reload are of no use and are
+-- removed by HistoryRetention.
+CREATE  TABLE yet_another_disk.deleted_items (
+                                                 id                   uuid  NOT NULL  ,
+                                                 deleted_at           timestamptz  DEFAULT now() NOT NULL  ,
+                                                 CONSTRAINT pk_deleted_items PRIMARY KEY ( id )
+);
+
+CREATE INDEX idx_deleted_items_deleted_at ON yet_another_disk.deleted_items ( deleted_at );
+
+-- Folders whose aggregate size was changed by a delta since SizeReconciler
+-- last looked at them. depth is the length of the folder's path, folders
+-- are checked deepest first. Inserting every folder here makes the next
+-- passes check the whole tree.
+CREATE  TABLE yet_another_disk.dirty_folders (
+                                                 id                   uuid  NOT NULL  ,
+                                                 depth                integer  NOT NULL  ,
+                                                 CONSTRAINT pk_dirty_folders PRIMARY KEY ( id )
+);
+
+CREATE INDEX idx_dirty_folders_depth ON yet_another_disk.dirty_folders ( depth, id );
+
+-- One row per change of an item: every import of a file and every change
+-- of a folder's aggregate size. Partitioned by month so that old history is
+-- dropped as whole partitions by yet_another_disk.drop_history_partitions.
 CREATE  TABLE yet_another_disk.history (
-                                           item_id              uuid    ,
-                                           "date-time"          timestamptz    ,
+                                           item_id              uuid  NOT NULL  ,
+                                           "date-time"          timestamptz  NOT NULL  ,
                                            parent_id            uuid    ,
                                            item_size            bigint    ,
-                                           url                  char(255)    ,
+                                           url                  text    ,
+                                           id_string            text    ,
+                                           parent_string        text    ,
+                                           item_type            yet_another_disk.item_type    ,
                                            CONSTRAINT fk_history_system_items FOREIGN KEY ( item_id ) REFERENCES yet_another_disk.system_items( id ) ON DELETE CASCADE
-);
+) PARTITION BY RANGE ( "date-time" );
+
+-- History rows carry the string ids, so /updates is a range scan of this
+-- index that never touches system_items.
+CREATE INDEX idx_history_date_time ON yet_another_disk.history ( "date-time" );
+CREATE INDEX idx_history_item_id ON yet_another_disk.history ( item_id, "date-time" );
+
+-- Rows outside every monthly partition, e.g. changes dated far in the past,
+-- land here instead of failing the write.
+CREATE TABLE yet_another_disk.history_default PARTITION OF yet_another_disk.history DEFAULT;
+
+-- Creates the monthly partition holding `at` unless it exists, moving the
+-- rows of that month out of the default partition first. HistoryRetention
+-- calls it ahead of time for the coming months, writes never do.
+CREATE FUNCTION yet_another_disk.create_history_partition(at timestamptz) RETURNS void AS $$
+DECLARE
+    month_start timestamptz := date_trunc('month', at AT TIME ZONE 'UTC') AT TIME ZONE 'UTC';
+    month_end timestamptz := month_start + interval '1 month';
+    partition_name text := 'history_' || to_char(month_start AT TIME ZONE 'UTC', 'YYYY_MM');
+BEGIN
+    PERFORM pg_advisory_xact_lock(hashtext('yet_another_disk.history'));
+    IF to_regclass('yet_another_disk.' || partition_name) IS NOT NULL THEN
+        RETURN;
+    END IF;
+    EXECUTE format('CREATE TABLE yet_another_disk.%I (LIKE yet_another_disk.history INCLUDING DEFAULTS)',
+                   partition_name);
+    EXECUTE format('WITH moved AS (DELETE FROM yet_another_disk.history_default'
+                   ' WHERE "date-time" >= %L AND "date-time" < %L RETURNING *)'
+                   ' INSERT INTO yet_another_disk.%I SELECT * FROM moved',
+                   month_start, month_end, partition_name);
+    EXECUTE format('ALTER TABLE yet_another_disk.history ATTACH PARTITION yet_another_disk.%I'
+                   ' FOR VALUES FROM (%L) TO (%L)',
+                   partition_name, month_start, month_end);
+END;
+$$ LANGUAGE plpgsql;
+
+-- Drops the monthly partitions that end before `cutoff` and deletes the
+-- default partition's rows older than it, returns how many partitions.
+CREATE FUNCTION yet_another_disk.drop_history_partitions(cutoff timestamptz) RETURNS integer AS $$
+DECLARE
+    partition_name text;
+    dropped integer := 0;
+BEGIN
+    FOR partition_name IN
+        SELECT c.relname
+        FROM pg_inherits i
+            JOIN pg_class c ON c.oid = i.inhrelid
+        WHERE i.inhparent = 'yet_another_disk.history'::regclass
+          AND c.relname ~ '^history_[0-9]{4}_[0-9]{2}$'
+          AND to_date(substring(c.relname FROM 9), 'YYYY_MM') + interval '1 month'
+                  <= cutoff AT TIME ZONE 'UTC'
+    LOOP
+        EXECUTE format('DROP TABLE yet_another_disk.%I', partition_name);
+        dropped := dropped + 1;
+    END LOOP;
+    DELETE FROM yet_another_disk.history_default WHERE "date-time" < cutoff;
+    RETURN dropped;
+END;
+$$ LANGUAGE plpgsql;
@@ -1,13 +1,30 @@
 #include "handlers.hpp"
+#include "history_retention.hpp"
+#include "metrics.hpp"
+#include "size_reconciler.hpp"
+#include "tree_cache.hpp"
 #include "userver/formats/json/string_builder.hpp"
 #include "userver/server/handlers/http_handler_json_base.hpp"
 
 
 
 #include <userver/clients/dns/component.hpp>
+#include <userver/engine/sleep.hpp>
+#include <userver/formats/json/exception.hpp>
+#include <userver/formats/json/serialize.hpp>
+#include <userver/formats/json/value_builder.hpp>
+#include <userver/formats/serialize/common_containers.hpp>
+#include <userver/http/common_headers.hpp>
+#include <userver/http/content_type.hpp>
+#include <userver/logging/log.hpp>
+#include <userver/server/http/http_response_body_stream.hpp>
 #include <userver/server/handlers/http_handler_base.hpp>
 #include <userver/storages/postgres/cluster.hpp>
 #include <userver/storages/postgres/component.hpp>
+#include <userver/utils/rand.hpp>
+#include <userver/utils/scope_guard.hpp>
+
+#include <algorithm>
 
 #include <boost/algorithm/string.hpp>
 
@@ -24,12 +41,14 @@ namespace yet_another_disk {
                   pg_cluster_(
                           component_context
                                   .FindComponent<components::Postgres>("postgres-db-1")
-                                  .GetCluster()) {}
+                                  .GetCluster()),
+                  metrics_(metrics().Handler(kName)),
+                  tree_cache_(component_context.FindComponent<TreeCache>()) {}
 
         formats::json::Value HandleRequestJsonThrow(
                 const server::http::HttpRequest &request, const formats::json::Value& json,
                 server::request::RequestContext &) const override {
-
+            const RequestScope scope(metrics_);
             auto parsed = getJsonArgs(json);
             auto validationFailed = [&request](){
                 request.SetResponseStatus(userver::server::http::HttpStatus::kBadRequest);
@@ -42,23 +61,23 @@ namespace yet_another_disk {
             if (parsed.has_value()) {
                 auto &args = parsed.value();
                 const auto date = args["updateDate"].As<storages::postgres::TimePointTz>();
-                auto trx = pg_cluster_->Begin(userver::storages::postgres::TransactionOptions{});
-                for (auto &elem: args["items"]) {
-                    auto prevValue = checkImport(elem, trx);
-                    if (!prevValue.has_value()) {
-                        return validationFailed();
-                    } else {
-                        const auto &prevElem = prevValue.value();
-                        if (!prevElem.IsEmpty() && !prevElem[0]["parent_id"].IsNull()) {
-                            const auto parentId = uuidGen(getStringFromField(prevElem[0]["parent_id"]));
-                            updateParent(
-                                    parentId,
-                                    -prevElem[0]["item_size"].As<long long>(), date, trx);
-                        }
-                        insertItem(elem, date, trx);
-                    }
+                auto items = parseImportItems(args["items"]);
+                if (!items.has_value()) {
+                    return validationFailed();
                 }
-                trx.Commit();
+                metrics_.items.Account(items.value().size());
+                const auto touched = retryOnConflict([&] {
+                    auto trx = pg_cluster_->Begin(userver::storages::postgres::TransactionOptions{});
+                    auto res = importItems(items.value(), date, trx);
+                    if (res.has_value())
+                        trx.Commit();
+                    return res;
+                });
+                if (!touched.has_value()) {
+                    return validationFailed();
+                }
+
+                tree_cache_.Refresh(touched.value());
                 request.SetResponseStatus(server::http::HttpStatus::kOk);
                 return {};
             } else {
@@ -68,36 +87,205 @@ namespace yet_another_disk {
         }
 
         storages::postgres::ClusterPtr pg_cluster_;
+        HandlerMetrics &metrics_;
+        TreeCache &tree_cache_;
     };
 
-    class Nodes final : public server::handlers::HttpHandlerJsonBase {
+    // Imports newline-delimited items, one JSON object per line, all with the
+    // updateDate given as a query argument. Lines are parsed one at a time
+    // and written in batches of `batch-size` items, each in its own
+    // transaction, so the batches before a failing one stay imported: the
+    // 400 response reports how many items were committed. Every committed
+    // batch is patched into the tree cache before the next one is read.
+    class BulkImports final : public server::handlers::HttpHandlerBase {
+    public:
+        static constexpr std::string_view kName = "handler-imports-bulk";
+
+        BulkImports(const components::ComponentConfig &config,
+                    const components::ComponentContext &component_context)
+                : HttpHandlerBase(config, component_context),
+                  pg_cluster_(
+                          component_context
+                                  .FindComponent<components::Postgres>("postgres-db-1")
+                                  .GetCluster()),
+                  metrics_(metrics().Handler(kName)),
+                  tree_cache_(component_context.FindComponent<TreeCache>()),
+                  batchSize_(config["batch-size"].As<std::size_t>(5000)) {}
+
+        std::string HandleRequestThrow(
+                const server::http::HttpRequest &request,
+                server::request::RequestContext &) const override {
+            const RequestScope scope(metrics_);
+            request.GetHttpResponse().SetContentType(http::content_type::kApplicationJson);
+            std::size_t imported = 0;
+            std::size_t batches = 0;
+            // Committed batches count on every way out, a failing line or
+            // batch does not roll them back.
+            const utils::ScopeGuard committed([this, &imported] {
+                metrics_.items.Account(imported);
+            });
+            auto validationFailed = [&request, &imported]() {
+                request.SetResponseStatus(userver::server::http::HttpStatus::kBadRequest);
+                return formats::json::ToString(formats::json::MakeObject(
+                        "code", 400,
+                        "message", "Validation failed",
+                        "imported", imported,
+                        "details", "Items counted in imported were committed before the failure and stay imported"
+                ));
+            };
+
+            const auto date = parseDate(request.GetArg("updateDate"));
+            if (!date.has_value()) {
+                return validationFailed();
+            }
+
+            std::vector<ImportItem> batch;
+            batch.reserve(batchSize_);
+            auto writeBatch = [&]() {
+                const auto touched = retryOnConflict([&] {
+                    auto trx = pg_cluster_->Begin(userver::storages::postgres::TransactionOptions{});
+                    auto res = importItems(batch, date.value(), trx);
+                    if (res.has_value())
+                        trx.Commit();
+                    return res;
+                });
+                if (!touched.has_value())
+                    return false;
+                tree_cache_.Refresh(touched.value());
+                imported += batch.size();
+                batch.clear();
+                batch.reserve(batchSize_);
+                ++batches;
+                LOG_INFO() << "Bulk import: " << imported << " items in " << batches << " batches";
+                return true;
+            };
+
+            const std::string_view body = request.RequestBody();
+            std::size_t lineStart = 0;
+            while (lineStart < body.size()) {
+                auto lineEnd = body.find('\n', lineStart);
+                if (lineEnd == std::string_view::npos)
+                    lineEnd = body.size();
+                auto line = body.substr(lineStart, lineEnd - lineStart);
+                lineStart = lineEnd + 1;
+                if (!line.empty() && line.back() == '\r')
+                    line.remove_suffix(1);
+                if (line.empty())
+                    continue;
+
+                std::optional<ImportItem> item;
+                try {
+                    item = parseImportItem(formats::json::FromString(line));
+                } catch (const formats::json::Exception &) {
+                }
+                if (!item.has_value()) {
+                    return validationFailed();
+                }
+                batch.push_back(std::move(item.value()));
+                if (batch.size() == batchSize_ && !writeBatch()) {
+                    return validationFailed();
+                }
+            }
+            if (!batch.empty() && !writeBatch()) {
+                return validationFailed();
+            }
+
+            return formats::json::ToString(formats::json::MakeObject(
+                    "imported", imported,
+                    "batches", batches
+            ));
+        }
+
+        storages::postgres::ClusterPtr pg_cluster_;
+        HandlerMetrics &metrics_;
+        TreeCache &tree_cache_;
+        std::size_t batchSize_;
+    };
+
+    class Nodes final : public server::handlers::HttpHandlerBase {
     public:
         static constexpr std::string_view kName = "handler-nodes";
 
         Nodes(const components::ComponentConfig &config,
               const components::ComponentContext &component_context)
-                : HttpHandlerJsonBase(config, component_context),
+                : HttpHandlerBase(config, component_context),
                   pg_cluster_(
                           component_context
                                   .FindComponent<components::Postgres>("postgres-db-1")
-                                  .GetCluster()) {}
+                                  .GetCluster()),
+                  metrics_(metrics().Handler(kName)),
+                  tree_cache_(component_context.FindComponent<TreeCache>()) {}
 
-        formats::json::Value HandleRequestJsonThrow(
-                const server::http::HttpRequest &request, const formats::json::Value& json,
+        std::string HandleRequestThrow(
+                const server::http::HttpRequest &,
                 server::request::RequestContext &) const override {
+            // The handler is configured with response-body-stream, so the
+            // response is produced in HandleStreamRequest.
+            return {};
+        }
+
+        // The subtree is written into the response as it is walked, in chunks
+        // of kChunkSize, so neither the rows nor the whole document are ever
+        // held in memory at once.
+        void HandleStreamRequest(
+                server::http::HttpRequest &request,
+                server::request::RequestContext &,
+                server::http::ResponseBodyStream &response_body_stream) const override {
+            const RequestScope scope(metrics_);
+            constexpr std::size_t kChunkSize = 64 * 1024;
+            bool headersSent = false;
+            auto sendHeaders = [&](server::http::HttpStatus status) {
+                response_body_stream.SetStatusCode(status);
+                response_body_stream.SetHeader(std::string{http::headers::kContentType}, "application/json");
+                response_body_stream.SetEndOfHeaders();
+                headersSent = true;
+            };
+            auto sendError = [&](server::http::HttpStatus status, formats::json::Value body) {
+                sendHeaders(status);
+                response_body_stream.PushBodyChunk(formats::json::ToString(body), engine::Deadline{});
+            };
+
             const std::string id = request.GetPathArg("id");
-            const auto uId = uuidGen(id);
-            auto trx = pg_cluster_->Begin(userver::storages::postgres::TransactionOptions{});
-            const auto res = getItemAndChildren(uId, id, trx);
-            if(res.has_value()){
-                return res.value();
+            const auto query = parseSubtreeQuery(request.GetArg("depth"), request.GetArg("limit"),
+                                                 request.GetArg("after"));
+            if (!query.has_value()) {
+                sendError(server::http::HttpStatus::kBadRequest,
+                          formats::json::MakeObject("code", 400, "message", "Validation failed"));
+                return;
             }
-            else {
-                return notFound(request);
+
+            SubtreeWriter writer([&](std::string &&chunk) {
+                if (!headersSent)
+                    sendHeaders(server::http::HttpStatus::kOk);
+                response_body_stream.PushBodyChunk(std::move(chunk), engine::Deadline{});
+            }, kChunkSize);
+
+            // The cache holds this instance's own writes at once, but writes
+            // through another instance only after its next update, so a hit
+            // may be up to a tree-cache update interval (10s) stale. A miss
+            // reads a replica, which lags by up to pg-max-replication-lag.
+            // Only consistency=strong reads the master and sees every
+            // committed write, whichever instance made it.
+            const auto hostType = readHostType(request);
+            bool found = hostType != storages::postgres::ClusterHostType::kMaster &&
+                         tree_cache_.WriteSubtree(id, query.value(), writer);
+            if (!found) {
+                auto trx = pg_cluster_->Begin(hostType, storages::postgres::Transaction::RO);
+                found = writeItemAndChildren(uuidGen(id), query.value(), trx, writer);
+                trx.Commit();
             }
+            if (!found) {
+                sendError(server::http::HttpStatus::kNotFound,
+                          formats::json::MakeObject("code", 404, "message", "Item not found"));
+                return;
+            }
+            writer.Finish();
+            metrics_.items.Account(writer.NodeCount());
         }
 
         storages::postgres::ClusterPtr pg_cluster_;
+        HandlerMetrics &metrics_;
+        TreeCache &tree_cache_;
     };
 
     class Delete final : public server::handlers::HttpHandlerJsonBase {
@@ -110,34 +298,143 @@ namespace yet_another_disk {
                   pg_cluster_(
                           component_context
                                   .FindComponent<components::Postgres>("postgres-db-1")
-                                  .GetCluster()) {}
+                                  .GetCluster()),
+                  metrics_(metrics().Handler(kName)),
+                  tree_cache_(component_context.FindComponent<TreeCache>()) {}
 
         formats::json::Value HandleRequestJsonThrow(
                 const server::http::HttpRequest &request, const formats::json::Value& json,
                 server::request::RequestContext &) const override {
+            const RequestScope scope(metrics_);
             const std::string id = request.GetPathArg("id");
-            const auto dateString = request.GetArg("date");
-            if(dateString.empty()){
+            const auto date = parseDate(request.GetArg("date"));
+            if (!date.has_value()) {
                 request.SetResponseStatus(userver::server::http::HttpStatus::kBadRequest);
                 return formats::json::MakeObject(
                         "code", 400,
                         "message", "Validation failed"
                 );
             }
-            const auto date = utils::datetime::Stringtime(request.GetArg("date"));
-            const auto uId = uuidGen(id);
-            auto trx = pg_cluster_->Begin(userver::storages::postgres::TransactionOptions{});
-            auto res = getItemById(uId, trx);
-            if(!res.IsEmpty()) {
-                deleteElemById(uId, trx);
-                trx.Commit();
-                return {};
-            }
-            else{
+            auto path = retryOnConflict([&] {
+                auto trx = pg_cluster_->Begin(userver::storages::postgres::TransactionOptions{});
+                auto res = deleteSubtree(uuidGen(id), date.value(), trx);
+                if (res.has_value())
+                    trx.Commit();
+                return res;
+            });
+            if (!path.has_value()) {
                 return notFound(request);
             }
+            path->pop_back();
+            tree_cache_.EraseSubtree(id);
+            tree_cache_.Refresh(path.value());
+            return {};
         }
         storages::postgres::ClusterPtr pg_cluster_;
+        HandlerMetrics &metrics_;
+        TreeCache &tree_cache_;
+    };
+
+    class Updates final : public server::handlers::HttpHandlerJsonBase {
+    public:
+        static constexpr std::string_view kName = "handler-updates";
+
+        Updates(const components::ComponentConfig &config,
+                const components::ComponentContext &component_context)
+                : HttpHandlerJsonBase(config, component_context),
+                  pg_cluster_(
+                          component_context
+                                  .FindComponent<components::Postgres>("postgres-db-1")
+                                  .GetCluster()),
+                  metrics_(metrics().Handler(kName)) {}
+
+        formats::json::Value HandleRequestJsonThrow(
+                const server::http::HttpRequest &request, const formats::json::Value&,
+                server::request::RequestContext &) const override {
+            const RequestScope scope(metrics_);
+            const auto date = parseDate(request.GetArg("date"));
+            if (!date.has_value()) {
+                request.SetResponseStatus(userver::server::http::HttpStatus::kBadRequest);
+                return formats::json::MakeObject(
+                        "code", 400,
+                        "message", "Validation failed"
+                );
+            }
+            return getUpdates(date.value(), *pg_cluster_, readHostType(request));
+        }
+
+        storages::postgres::ClusterPtr pg_cluster_;
+        HandlerMetrics &metrics_;
+    };
+
+    class NodeHistory final : public server::handlers::HttpHandlerJsonBase {
+    public:
+        static constexpr std::string_view kName = "handler-node-history";
+
+        NodeHistory(const components::ComponentConfig &config,
+                    const components::ComponentContext &component_context)
+                : HttpHandlerJsonBase(config, component_context),
+                  pg_cluster_(
+                          component_context
+                                  .FindComponent<components::Postgres>("postgres-db-1")
+                                  .GetCluster()),
+                  metrics_(metrics().Handler(kName)) {}
+
+        formats::json::Value HandleRequestJsonThrow(
+                const server::http::HttpRequest &request, const formats::json::Value&,
+                server::request::RequestContext &) const override {
+            const RequestScope scope(metrics_);
+            const auto &startString = request.GetArg("dateStart");
+            const auto &endString = request.GetArg("dateEnd");
+            const auto dateStart = parseDate(startString);
+            const auto dateEnd = parseDate(endString);
+            if ((!startString.empty() && !dateStart.has_value()) ||
+                (!endString.empty() && !dateEnd.has_value()) ||
+                (dateStart.has_value() && dateEnd.has_value() &&
+                 dateEnd->GetUnderlying() < dateStart->GetUnderlying())) {
+                request.SetResponseStatus(userver::server::http::HttpStatus::kBadRequest);
+                return formats::json::MakeObject(
+                        "code", 400,
+                        "message", "Validation failed"
+                );
+            }
+            auto trx = pg_cluster_->Begin(readHostType(request), storages::postgres::Transaction::RO);
+            auto res = getItemHistory(uuidGen(request.GetPathArg("id")), dateStart, dateEnd, trx);
+            trx.Commit();
+            if (!res.has_value())
+                return notFound(request);
+            return std::move(res.value());
+        }
+
+        storages::postgres::ClusterPtr pg_cluster_;
+        HandlerMetrics &metrics_;
+    };
+
+    class NodeStats final : public server::handlers::HttpHandlerJsonBase {
+    public:
+        static constexpr std::string_view kName = "handler-node-stats";
+
+        NodeStats(const components::ComponentConfig &config,
+                  const components::ComponentContext &component_context)
+                : HttpHandlerJsonBase(config, component_context),
+                  pg_cluster_(
+                          component_context
+                                  .FindComponent<components::Postgres>("postgres-db-1")
+                                  .GetCluster()),
+                  metrics_(metrics().Handler(kName)) {}
+
+        formats::json::Value HandleRequestJsonThrow(
+                const server::http::HttpRequest &request, const formats::json::Value&,
+                server::request::RequestContext &) const override {
+            const RequestScope scope(metrics_);
+            auto res = getItemStats(uuidGen(request.GetPathArg("id")), *pg_cluster_, readHostType(request));
+            if (!res.has_value())
+                return notFound(request);
+            return std::move(res.value());
+        }
+
+        storages::postgres::ClusterPtr pg_cluster_;
+        HandlerMetrics &metrics_;
     };
 
     std::optional<std::map<std::string, formats::json::Value>> getJsonArgs(
@@ -152,46 +449,239 @@ namespace yet_another_disk {
         }
     }
 
-    std::optional<storages::postgres::ResultSet> checkImport(const formats::json::Value &elem,
-                                                             storages::postgres::Transaction &trx) {
-        const auto name = elem["id"].As<std::string>("");
-        const auto importType = elem["type"].As<std::string>("");
-        if (name.empty() || importType.empty()) {
+    std::optional<ImportItem> parseImportItem(const formats::json::Value &elem) {
+        ImportItem item;
+        item.id = elem["id"].As<std::string>("");
+        item.type = elem["type"].As<std::string>("");
+        if (item.id.empty() || item.type.empty()) {
             return {};
         }
-
-        auto getItemType = [](const storages::postgres::ResultSet &arg) {
-            if (!arg.IsEmpty() && !arg[0]["item_type"].IsNull()) {
-                storages::postgres::Field res = arg[0]["item_type"];
-                return boost::algorithm::trim_right_copy(arg[0]["item_type"].As<std::string>());
-            } else
-                return std::string();
-        };
-        auto res = getItemById(uuidGen(name), trx);
-        std::string type = getItemType(res);
-        if (!type.empty() && type != importType) {
+        if (item.type == kFolder) {
+            if (!checkFolder(elem))
+                return {};
+        } else if (item.type == kFile) {
+            if (!checkFile(elem))
+                return {};
+        } else {
             return {};
         }
 
-        const auto parentId = elem["parentId"].As<std::string>("");
-        auto parentRes = getItemById(uuidGen(parentId), trx);
-        std::string parent_type = getItemType(parentRes);
-        if (!parentId.empty() && parent_type != kFolder) {
-            return {};
-        }
-        if (importType == kFolder) {
-            if (checkFolder(elem))
-                return res;
-            else
+        item.uId = uuidGen(item.id);
+        item.parentId = elem["parentId"].As<std::string>("");
+        if (!item.parentId.empty()) {
+            item.uParent = uuidGen(item.parentId);
+            if (item.uParent == item.uId)
                 return {};
-        } else if (importType == kFile) {
-            if (checkFile(elem))
-                return res;
-            else
+        }
+        item.url = elem["url"].As<std::string>("");
+        item.size = elem["size"].As<long long>(0);
+        return item;
+    }
+
+    std::optional<std::vector<ImportItem>> parseImportItems(const formats::json::Value &items) {
+        std::vector<ImportItem> res;
+        res.reserve(items.GetSize());
+        for (const auto &elem: items) {
+            auto item = parseImportItem(elem);
+            if (!item.has_value())
                 return {};
-        } else {
+            res.push_back(std::move(item.value()));
+        }
+        return res;
+    }
+
+    void backoffAfterConflict(std::size_t attempt) {
+        ++metrics().conflictRetries;
+        LOG_WARNING() << "Transaction conflict, retrying, attempt " << attempt;
+        const auto limit = kConflictBackoff * (1 << (attempt - 1));
+        engine::SleepFor(std::chrono::milliseconds{utils::RandRange(limit.count() / 2, limit.count() + 1)});
+    }
+
+    std::optional<std::vector<boost::uuids::uuid>> importItems(const std::vector<ImportItem> &items,
+                                                               const storages::postgres::TimePointTz &date,
+                                                               storages::postgres::Transaction &trx) {
+        const auto stored = lockItems(collectReferencedIds(items), trx);
+        if (!validateImport(items, stored)) {
+            return {};
+        }
+        const auto batch = dedupeImportItems(items);
+        const auto parents = buildParentMap(batch, stored);
+        const auto paths = buildPaths(batch, parents);
+        if (!paths.has_value()) {
             return {};
         }
+        insertItems(batch, paths.value(), date, trx);
+        updateDescendantPaths(collectMovedFolders(batch, paths.value(), stored), trx);
+        const auto deltas = spreadDeltas(collectParentDeltas(batch, stored), parents);
+        applyFolderDeltas(deltas, date, trx);
+
+        std::vector<boost::uuids::uuid> touched;
+        touched.reserve(batch.size() + deltas.size());
+        for (const auto &item: batch) {
+            touched.push_back(item.uId);
+        }
+        for (const auto &[id, changeSize]: deltas) {
+            touched.push_back(id);
+        }
+        return touched;
+    }
+
+    std::vector<boost::uuids::uuid> collectReferencedIds(const std::vector<ImportItem> &items) {
+        std::vector<boost::uuids::uuid> ids;
+        ids.reserve(items.size() * 2);
+        for (const auto &item: items) {
+            ids.push_back(item.uId);
+            if (item.uParent.has_value())
+                ids.push_back(item.uParent.value());
+        }
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        return ids;
+    }
+
+    StoredItems getItemsByIds(const std::vector<boost::uuids::uuid> &ids,
+                              storages::postgres::Transaction &trx, bool forUpdate) {
+        const static storages::postgres::Query query{"SELECT\n"
+                                                     "\ts.id, s.item_type::text, s.item_size, s.parent_id, s.path,\n"
+                                                     "\ts.file_count, s.max_depth\n"
+                                                     "FROM\n"
+                                                     "\tyet_another_disk.system_items s\n"
+                                                     "WHERE\n"
+                                                     "    id = ANY($1);",
+                                                     storages::postgres::Query::Name{"get_items_by_ids"}};
+        const static storages::postgres::Query lockQuery{"SELECT\n"
+                                                         "\ts.id, s.item_type::text, s.item_size, s.parent_id, s.path,\n"
+                                                         "\ts.file_count, s.max_depth\n"
+                                                         "FROM\n"
+                                                         "\tyet_another_disk.system_items s\n"
+                                                         "WHERE\n"
+                                                         "    id = ANY($1)\n"
+                                                         "ORDER BY id\n"
+                                                         "FOR UPDATE;",
+                                                         storages::postgres::Query::Name{"lock_items_by_ids"}};
+        StoredItems res;
+        if (ids.empty())
+            return res;
+        static auto &queryTime = metrics().Query("get_items_by_ids");
+        static auto &lockTime = metrics().Query("lock_items_by_ids");
+        const QueryTimer timer(forUpdate ? lockTime : queryTime);
+        const auto rows = trx.Execute(forUpdate ? lockQuery : query, ids);
+        res.reserve(rows.Size());
+        for (const auto &row: rows) {
+            auto [id, type, size, parentId, path, files, maxDepth] =
+                    row.As<boost::uuids::uuid, std::string, long long, std::optional<boost::uuids::uuid>, ItemPath,
+                           long long, int>();
+            res.emplace(id, StoredItem{std::move(type), parentId, size, std::move(path), files, maxDepth});
+        }
+        return res;
+    }
+
+    StoredItems lockItems(std::vector<boost::uuids::uuid> ids, storages::postgres::Transaction &trx) {
+        // Every row an import writes is either referenced by the batch or an
+        // ancestor of one that is. All of them are locked up front in uuid
+        // order, so concurrent imports of the same tree queue up on their
+        // first common row instead of deadlocking over shared ancestors. The
+        // ancestors are only known once the referenced rows are read, and may
+        // change until they are locked, so locking repeats until it covers
+        // the paths it returns.
+        auto stored = getItemsByIds(ids, trx, false);
+        for (;;) {
+            for (const auto &[id, item]: stored) {
+                ids.insert(ids.end(), item.path.begin(), item.path.end());
+            }
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            stored = getItemsByIds(ids, trx, true);
+            const bool covered = std::all_of(stored.begin(), stored.end(), [&ids](const auto &entry) {
+                const auto &path = entry.second.path;
+                return std::all_of(path.begin(), path.end(), [&ids](const auto &ancestor) {
+                    return std::binary_search(ids.begin(), ids.end(), ancestor);
+                });
+            });
+            if (covered)
+                return stored;
+        }
+    }
+
+    bool validateImport(const std::vector<ImportItem> &items, const StoredItems &stored) {
+        // Items are checked in request order, so a parent created earlier
+        // in the same batch is as good as one that is already stored.
+        std::unordered_map<boost::uuids::uuid, std::string_view, UuidHash> types;
+        types.reserve(stored.size() + items.size());
+        for (const auto &[id, item]: stored) {
+            types.emplace(id, item.type);
+        }
+        for (const auto &item: items) {
+            const auto prev = types.find(item.uId);
+            if (prev != types.end() && prev->second != item.type) {
+                return false;
+            }
+            if (item.uParent.has_value()) {
+                const auto parent = types.find(item.uParent.value());
+                if (parent == types.end() || parent->second != kFolder) {
+                    return false;
+                }
+            }
+            types[item.uId] = item.type;
+        }
+        return true;
+    }
+
+    std::vector<ImportItem> dedupeImportItems(std::vector<ImportItem> items) {
+        // A single upsert can't touch the same row twice, the last occurrence wins.
+        std::unordered_map<boost::uuids::uuid, std::size_t, UuidHash> lastIndex;
+        lastIndex.reserve(items.size());
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            lastIndex[items[i].uId] = i;
+        }
+        if (lastIndex.size() == items.size())
+            return items;
+
+        std::vector<ImportItem> res;
+        res.reserve(lastIndex.size());
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            if (lastIndex[items[i].uId] == i)
+                res.push_back(std::move(items[i]));
+        }
+        return res;
+    }
+
+    FolderDeltas collectParentDeltas(const std::vector<ImportItem> &items, const StoredItems &stored) {
+        // Every item takes its stored size and file count away from its old
+        // parent and brings its new ones (or its kept aggregates, for
+        // folders) to the new one. Spread up the resulting tree this is exact
+        // even when folders and their contents are moved within the same
+        // batch. The old parent's depth is left to SizeReconciler.
+        FolderDeltas deltas;
+        for (const auto &item: items) {
+            const auto prev = stored.find(item.uId);
+            long long prevSize = 0;
+            long long prevFiles = 0;
+            int prevDepth = 0;
+            if (prev != stored.end()) {
+                prevSize = prev->second.size;
+                prevFiles = prev->second.type == kFile ? 1 : prev->second.files;
+                prevDepth = prev->second.maxDepth;
+                if (prev->second.parentId.has_value()) {
+                    auto &delta = deltas[prev->second.parentId.value()];
+                    delta.size -= prevSize;
+                    delta.files -= prevFiles;
+                }
+            }
+            if (!item.uParent.has_value())
+                continue;
+            auto &delta = deltas[item.uParent.value()];
+            if (item.type == kFile) {
+                delta.size += item.size;
+                delta.files += 1;
+            } else {
+                delta.size += prevSize;
+                delta.files += prevFiles;
+                delta.maxDepth = std::max(delta.maxDepth, prevDepth + 1);
+            }
+            delta.maxDepth = std::max(delta.maxDepth, 1);
+        }
+        return deltas;
     }
 
     bool checkFile(const formats::json::Value &elem) {
@@ -212,189 +702,610 @@ namespace yet_another_disk {
         }
     }
 
-    void updateParent(const boost::uuids::uuid &id, long long changeSize, storages::postgres::TimePointTz date,
-                      storages::postgres::Transaction &trx) {
-        const static std::string updateQuery = "WITH RECURSIVE r AS (\n"
-                                               "   SELECT id, parent_id, item_size, item_type\n"
-                                               "   FROM yet_another_disk.system_items\n"
-                                               "   WHERE id = $1\n"
-                                               "   UNION\n"
-                                               "   SELECT items.id, items.parent_id, items.item_size, items.item_type\n"
-                                               "   FROM yet_another_disk.system_items as items\n"
-                                               "      JOIN r\n"
-                                               "          ON items.id = r.parent_id\n"
-                                               ")\n"
-                                               "UPDATE yet_another_disk.system_items items\n"
-                                               "    SET item_size = item_size + $2,\n"
-                                               "        \"date-time\" = $3\n"
-                                               "    WHERE items.id in (SELECT id FROM r) ;";
+    ParentMap buildParentMap(const std::vector<ImportItem> &items, const StoredItems &stored) {
+        // Stored paths already hold every ancestor of the referenced items,
+        // the batch is laid over them to get the tree as it will be after
+        // the import without another query.
+        ParentMap res;
+        for (const auto &[id, item]: stored) {
+            std::optional<boost::uuids::uuid> parent;
+            for (const auto &ancestor: item.path) {
+                res.emplace(ancestor, parent);
+                parent = ancestor;
+            }
+        }
+        for (const auto &item: items) {
+            res.insert_or_assign(item.uId, item.uParent);
+        }
+        return res;
+    }
+
+    std::optional<ItemPath> pathTo(const boost::uuids::uuid &id, const ParentMap &parents) {
+        ItemPath res;
+        std::optional<boost::uuids::uuid> current = id;
+        while (current.has_value()) {
+            // Longer than the whole map means the chain loops back on itself.
+            if (res.size() > parents.size())
+                return {};
+            res.push_back(current.value());
+            const auto next = parents.find(current.value());
+            if (next == parents.end())
+                break;
+            current = next->second;
+        }
+        std::reverse(res.begin(), res.end());
+        return res;
+    }
+
+    std::optional<std::vector<ItemPath>> buildPaths(const std::vector<ImportItem> &items, const ParentMap &parents) {
+        std::vector<ItemPath> res;
+        res.reserve(items.size());
+        for (const auto &item: items) {
+            auto path = pathTo(item.uId, parents);
+            if (!path.has_value())
+                return {};
+            res.push_back(std::move(path.value()));
+        }
+        return res;
+    }
+
+    std::string formatPath(const ItemPath &path) {
+        std::string res = "{";
+        for (const auto &id: path) {
+            if (res.size() > 1)
+                res += ',';
+            res += boost::uuids::to_string(id);
+        }
+        res += '}';
+        return res;
+    }
+
+    std::vector<boost::uuids::uuid> collectMovedFolders(const std::vector<ImportItem> &items,
+                                                        const std::vector<ItemPath> &paths,
+                                                        const StoredItems &stored) {
+        std::vector<boost::uuids::uuid> res;
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            if (items[i].type != kFolder)
+                continue;
+            const auto prev = stored.find(items[i].uId);
+            if (prev != stored.end() && prev->second.path != paths[i])
+                res.push_back(items[i].uId);
+        }
+        return res;
+    }
+
+    void updateDescendantPaths(const std::vector<boost::uuids::uuid> &moved,
+                               storages::postgres::Transaction &trx) {
+        // Moved folders already have their new path. Every row below them
+        // still has the old one and takes the new prefix of the deepest
+        // moved folder it contains, the part below it did not change.
+        const static storages::postgres::Query query{"UPDATE yet_another_disk.system_items items\n"
+                                                     "    SET path = m.path || items.path[m.pos + 1:]\n"
+                                                     "    FROM (\n"
+                                                     "        SELECT DISTINCT ON (s.id) s.id, f.path, array_position(s.path, f.id) AS pos\n"
+                                                     "        FROM yet_another_disk.system_items f\n"
+                                                     "            JOIN yet_another_disk.system_items s\n"
+                                                     "                ON s.path @> ARRAY[f.id] AND s.id <> f.id\n"
+                                                     "        WHERE f.id = ANY($1)\n"
+                                                     "        ORDER BY s.id, array_position(s.path, f.id) DESC\n"
+                                                     "    ) m\n"
+                                                     "    WHERE items.id = m.id;",
+                                                     storages::postgres::Query::Name{"update_descendant_paths"}};
+        if (moved.empty())
+            return;
+        static auto &queryTime = metrics().Query("update_descendant_paths");
+        const QueryTimer timer(queryTime);
+        trx.Execute(query, moved);
+    }
 
+    FolderDeltas spreadDeltas(const FolderDeltas &parentDeltas, const ParentMap &parents) {
+        // Each folder gets the sum of the deltas of all touched folders in
+        // its subtree, so it is written once per import however many files
+        // below it were changed. A subtree attached k levels below a folder
+        // makes the folder k levels deeper than the subtree's own parent.
+        FolderDeltas res;
+        res.reserve(parents.size());
+        for (const auto &[parentId, change]: parentDeltas) {
+            std::optional<boost::uuids::uuid> current = parentId;
+            for (std::size_t depth = 0; current.has_value() && depth <= parents.size(); ++depth) {
+                auto &delta = res[current.value()];
+                delta.size += change.size;
+                delta.files += change.files;
+                if (change.maxDepth > 0)
+                    delta.maxDepth = std::max(delta.maxDepth, change.maxDepth + static_cast<int>(depth));
+                const auto next = parents.find(current.value());
+                if (next == parents.end())
+                    break;
+                current = next->second;
+            }
+        }
+        return res;
+    }
 
-        trx.Execute(updateQuery, id, changeSize, date);
+    void applyFolderDeltas(const FolderDeltas &deltas, storages::postgres::TimePointTz date,
+                           storages::postgres::Transaction &trx) {
+        // Every folder whose aggregate changed is left for SizeReconciler to
+        // check, those whose size changed get a history row as well.
+        const static storages::postgres::Query updateQuery{"WITH updated AS (\n"
+                                                           "UPDATE yet_another_disk.system_items items\n"
+                                                           "    SET item_size = items.item_size + d.size,\n"
+                                                           "        file_count = items.file_count + d.files,\n"
+                                                           "        max_depth = GREATEST(items.max_depth, d.max_depth),\n"
+                                                           "        last_modified = GREATEST(items.last_modified, $5),\n"
+                                                           "        \"date-time\" = $5\n"
+                                                           "    FROM UNNEST($1::uuid[], $2::bigint[], $3::bigint[], $4::integer[])\n"
+                                                           "        AS d(id, size, files, max_depth)\n"
+                                                           "    WHERE items.id = d.id\n"
+                                                           "RETURNING items.id, items.id_string, items.url,\n"
+                                                           "          items.parent_id, items.item_type, items.item_size, items.path,\n"
+                                                           "          d.size AS delta\n"
+                                                           "), dirtied AS (\n"
+                                                           "INSERT INTO yet_another_disk.dirty_folders (id, depth)\n"
+                                                           "SELECT id, array_length(path, 1) FROM updated\n"
+                                                           "ON CONFLICT (id) DO NOTHING\n"
+                                                           ")\n"
+                                                           "INSERT INTO yet_another_disk.history\n"
+                                                           "\t( item_id, id_string, parent_string, url, parent_id, item_type, item_size, \"date-time\")\n"
+                                                           "SELECT u.id, u.id_string, p.id_string, u.url, u.parent_id, u.item_type, u.item_size, $5\n"
+                                                           "FROM updated u\n"
+                                                           "    LEFT JOIN yet_another_disk.system_items p ON p.id = u.parent_id\n"
+                                                           "WHERE u.delta <> 0;",
+                                                           storages::postgres::Query::Name{"apply_folder_deltas"}};
+        if (deltas.empty())
+            return;
+        std::vector<boost::uuids::uuid> ids;
+        std::vector<long long> sizes, files;
+        std::vector<int> depths;
+        ids.reserve(deltas.size());
+        sizes.reserve(deltas.size());
+        files.reserve(deltas.size());
+        depths.reserve(deltas.size());
+        for (const auto &[id, delta]: deltas) {
+            ids.push_back(id);
+            sizes.push_back(delta.size);
+            files.push_back(delta.files);
+            depths.push_back(delta.maxDepth);
+        }
+        static auto &queryTime = metrics().Query("apply_folder_deltas");
+        const QueryTimer timer(queryTime);
+        trx.Execute(updateQuery, ids, sizes, files, depths, date);
     }
 
     storages::postgres::ResultSet getItemById(const boost::uuids::uuid &id,
                                               storages::postgres::Transaction &trx) {
-        const static std::string &query = "SELECT\n"
-                                          "\ts.id, s.item_type, s.item_size, s.parent_id, s.url, s.\"date-time\"\n"
-                                          "FROM\n"
-                                          "\tyet_another_disk.system_items s\n"
-                                          "WHERE\n"
-                                          "    id=$1;";
+        const static storages::postgres::Query query{"SELECT\n"
+                                                     "\ts.id, s.item_type::text, s.item_size, s.parent_id, s.url, s.\"date-time\", s.path\n"
+                                                     "FROM\n"
+                                                     "\tyet_another_disk.system_items s\n"
+                                                     "WHERE\n"
+                                                     "    id=$1;",
+                                                     storages::postgres::Query::Name{"get_item_by_id"}};
+        static auto &queryTime = metrics().Query("get_item_by_id");
+        const QueryTimer timer(queryTime);
         return trx.Execute(query, id);
     }
 
-    void insertItem(const formats::json::Value &elem,
-                    const userver::storages::postgres::TimePointTz &date,
-                    storages::postgres::Transaction &trx) {
-        const static std::string insertItem = "INSERT INTO yet_another_disk.system_items\n"
-                                              "\t( id_string, parent_string, id, url, parent_id, item_type, item_size, \"date-time\") "
-                                              "VALUES ( $1, $2, $3, $4, $5, $6, $7, $8)\n"
-                                              "ON CONFLICT (id) DO UPDATE\n"
-                                              "    SET id=excluded.id,\n"
-                                              "           url=excluded.url,\n"
-                                              "           parent_id=excluded.parent_id,\n"
-                                              "           item_type=excluded.item_type,\n"
-                                              "           item_size=excluded.item_size,\n"
-                                              "           \"date-time\"=excluded.\"date-time\"";
-        const static std::string insertStory = "INSERT INTO yet_another_disk.history\n"
-                                               "\t( item_id, url, parent_id, \"date-time\") "
-                                               "VALUES ( $1, $2, $3, $4);";
-
-        const auto type = elem["type"].As<std::string>();
-
-        const auto id = elem["id"].As<std::string>();
-        const auto uId = uuidGen(id);
-        const auto parent = elem["parentId"].As<std::string>("");
-        std::optional<boost::uuids::uuid> uParent;
-        std::optional<std::string> parentId;
-        if(!parent.empty()){
-            uParent = uuidGen(parent);
-            parentId = parent;
-        }
-
-        std::optional<std::string> url = elem["url"].As<std::string>("");
-        if(url.value().empty())
-            url = std::nullopt;
-        const auto itemSize = elem["size"].As<long long>(0);
-
-        trx.Execute(insertItem, id, parentId, uId, url,
-                    uParent, type, itemSize, date);
-        if (elem["type"].As<std::string>() == kFile) {
-            trx.Execute(insertStory, uId, url, uParent, date);
-            if (!parent.empty() && elem["type"].As<std::string>() == kFile) {
-                updateParent(uParent.value(), itemSize, date, trx);
-            }
+    void insertItems(const std::vector<ImportItem> &items,
+                     const std::vector<ItemPath> &paths,
+                     const userver::storages::postgres::TimePointTz &date,
+                     storages::postgres::Transaction &trx) {
+        // Folders keep their aggregated size on re-import, it is only moved
+        // between ancestors by applyFolderDeltas, and so are their file count
+        // and depth.
+        // The parent's string id is not stored with the item, history rows
+        // take it from the batch.
+        const static storages::postgres::Query insertItems{"WITH input AS (\n"
+                                                           "SELECT t.id_string, NULLIF(t.parent_string, '') AS parent_string, t.id,\n"
+                                                           "       NULLIF(t.url, '') AS url,\n"
+                                                           "       NULLIF(t.parent_id, '00000000-0000-0000-0000-000000000000'::uuid) AS parent_id,\n"
+                                                           "       t.item_type::yet_another_disk.item_type AS item_type, t.item_size,\n"
+                                                           "       t.path::uuid[] AS path\n"
+                                                           "FROM UNNEST($1::text[], $2::text[], $3::uuid[], $4::text[],\n"
+                                                           "            $5::uuid[], $6::text[], $7::bigint[], $9::text[])\n"
+                                                           "    AS t(id_string, parent_string, id, url, parent_id, item_type, item_size, path)\n"
+                                                           "), upserted AS (\n"
+                                                           "INSERT INTO yet_another_disk.system_items\n"
+                                                           "\t( id_string, id, url, parent_id, item_type, item_size, \"date-time\", path,\n"
+                                                           "\t  file_count, max_depth, last_modified)\n"
+                                                           "SELECT i.id_string, i.id, i.url, i.parent_id, i.item_type, i.item_size, $8, i.path,\n"
+                                                           "       CASE WHEN i.item_type = 'FILE' THEN 1 ELSE 0 END, 0, $8\n"
+                                                           "FROM input i\n"
+                                                           "ON CONFLICT (id) DO UPDATE\n"
+                                                           "    SET url=excluded.url,\n"
+                                                           "           parent_id=excluded.parent_id,\n"
+                                                           "           path=excluded.path,\n"
+                                                           "           item_type=excluded.item_type,\n"
+                                                           "           item_size=CASE WHEN excluded.item_type = 'FILE'\n"
+                                                           "                          THEN excluded.item_size\n"
+                                                           "                          ELSE system_items.item_size END,\n"
+                                                           "           \"date-time\"=excluded.\"date-time\",\n"
+                                                           "           last_modified=GREATEST(system_items.last_modified, excluded.last_modified)\n"
+                                                           "RETURNING id, id_string, url, parent_id, item_type, item_size\n"
+                                                           ")\n"
+                                                           "INSERT INTO yet_another_disk.history\n"
+                                                           "\t( item_id, id_string, parent_string, url, parent_id, item_type, item_size, \"date-time\")\n"
+                                                           "SELECT u.id, u.id_string, i.parent_string, u.url, u.parent_id, u.item_type, u.item_size, $8\n"
+                                                           "FROM upserted u\n"
+                                                           "    JOIN input i ON i.id = u.id\n"
+                                                           "WHERE u.item_type = 'FILE';",
+                                                           storages::postgres::Query::Name{"insert_items"}};
+        if (items.empty())
+            return;
+
+        std::vector<std::string> idStrings, parentStrings, urls, types, itemPaths;
+        std::vector<boost::uuids::uuid> ids, parentIds;
+        std::vector<long long> sizes;
+        idStrings.reserve(items.size());
+        parentStrings.reserve(items.size());
+        urls.reserve(items.size());
+        types.reserve(items.size());
+        ids.reserve(items.size());
+        parentIds.reserve(items.size());
+        sizes.reserve(items.size());
+        itemPaths.reserve(items.size());
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            const auto &item = items[i];
+            idStrings.push_back(item.id);
+            parentStrings.push_back(item.parentId);
+            ids.push_back(item.uId);
+            urls.push_back(item.url);
+            parentIds.push_back(item.uParent.value_or(boost::uuids::nil_uuid()));
+            types.push_back(item.type);
+            sizes.push_back(item.size);
+            itemPaths.push_back(formatPath(paths[i]));
         }
+
+        static auto &queryTime = metrics().Query("insert_items");
+        const QueryTimer timer(queryTime);
+        trx.Execute(insertItems, idStrings, parentStrings, ids, urls,
+                    parentIds, types, sizes, date, itemPaths);
     }
 
-    std::string getStringFromField(const storages::postgres::Field &elem) {
-        if (!elem.IsNull())
-            return boost::algorithm::trim_right_copy(elem.As<std::string>());
-        else
-            return {};
+    formats::json::Value getUpdates(const storages::postgres::TimePointTz &date,
+                                    storages::postgres::Cluster &cluster,
+                                    storages::postgres::ClusterHostType hostType) {
+        // Only the last change of a file inside the window is reported.
+        const static storages::postgres::Query query{"SELECT DISTINCT ON (h.item_id)\n"
+                                                     "\th.id_string, h.parent_string, h.item_type::text, h.url, h.item_size, h.\"date-time\"\n"
+                                                     "FROM yet_another_disk.history h\n"
+                                                     "WHERE h.\"date-time\" BETWEEN $1 - interval '24 hours' AND $1\n"
+                                                     "  AND h.item_type = 'FILE'\n"
+                                                     "ORDER BY h.item_id, h.\"date-time\" DESC;",
+                                                     storages::postgres::Query::Name{"get_updates"}};
+        static auto &queryTime = metrics().Query("get_updates");
+        const QueryTimer timer(queryTime);
+        const auto res = cluster.Execute(hostType, query, date);
+
+        formats::json::ValueBuilder items(formats::json::Type::kArray);
+        for (const auto &row: res) {
+            items.PushBack(historyRowToJson(row.As<NodeRow>(storages::postgres::kRowTag)));
+        }
+        formats::json::ValueBuilder response;
+        response["items"] = std::move(items);
+        return response.ExtractValue();
     }
 
-    std::optional<formats::json::Value> getItemAndChildren(const boost::uuids::uuid &uid, const std::string &id,
-                                                     storages::postgres::Transaction &trx){
-        const std::string query = "WITH RECURSIVE r AS (\n"
-                                  "   SELECT *, 1 AS level\n"
-                                  "   FROM yet_another_disk.system_items\n"
-                                  "   WHERE id = $1\n"
-                                  "   UNION\n"
-                                  "   SELECT items.*, r.level + 1 AS level\n"
-                                  "   FROM yet_another_disk.system_items as items\n"
-                                  "      JOIN r\n"
-                                  "          ON items.parent_id = r.id\n"
-                                  ")\n"
-                                  "SELECT * FROM  r\n"
-                                  "ORDER BY item_type DESC, level DESC;";
-        auto res = trx.Execute(query, uid);
-        if(!res.IsEmpty()){
-            auto strJson = parseRes(res, id).dump(4);
-            return formats::json::FromString(strJson);
+    std::optional<formats::json::Value> getItemHistory(const boost::uuids::uuid &id,
+                                                       const std::optional<storages::postgres::TimePointTz> &dateStart,
+                                                       const std::optional<storages::postgres::TimePointTz> &dateEnd,
+                                                       storages::postgres::Transaction &trx) {
+        const static storages::postgres::Query query{"SELECT\n"
+                                                     "\th.id_string, h.parent_string, h.item_type::text, h.url, h.item_size, h.\"date-time\"\n"
+                                                     "FROM yet_another_disk.history h\n"
+                                                     "WHERE h.item_id = $1\n"
+                                                     "  AND ($2::timestamptz IS NULL OR h.\"date-time\" >= $2)\n"
+                                                     "  AND ($3::timestamptz IS NULL OR h.\"date-time\" < $3)\n"
+                                                     "ORDER BY h.\"date-time\";",
+                                                     storages::postgres::Query::Name{"get_item_history"}};
+        // Existence is only checked when there is no history to return,
+        // which saves a round trip for every file.
+        static auto &queryTime = metrics().Query("get_item_history");
+        const auto res = [&] {
+            const QueryTimer timer(queryTime);
+            return trx.Execute(query, id, dateStart, dateEnd);
+        }();
+        if (res.IsEmpty() && getItemById(id, trx).IsEmpty())
+            return {};
+
+        formats::json::ValueBuilder items(formats::json::Type::kArray);
+        for (const auto &row: res) {
+            items.PushBack(historyRowToJson(row.As<NodeRow>(storages::postgres::kRowTag)));
         }
-        else
+        formats::json::ValueBuilder response;
+        response["items"] = std::move(items);
+        return response.ExtractValue();
+    }
+
+    formats::json::Value historyRowToJson(const NodeRow &row) {
+        formats::json::ValueBuilder item;
+        item["id"] = row.id;
+        item["type"] = row.type;
+        item["url"] = row.url;
+        item["parentId"] = row.parentId;
+        item["size"] = row.size;
+        item["date"] = utils::datetime::Timestring(row.date.GetUnderlying());
+        return item.ExtractValue();
+    }
+
+    std::optional<formats::json::Value> getItemStats(const boost::uuids::uuid &id,
+                                                     storages::postgres::Cluster &cluster,
+                                                     storages::postgres::ClusterHostType hostType) {
+        // The aggregates are kept on the item's own row by every write, so
+        // this is a single primary key lookup whatever the size of the subtree.
+        const static storages::postgres::Query query{"SELECT\n"
+                                                     "\ts.id_string, s.item_type::text, s.item_size, s.file_count, s.max_depth,\n"
+                                                     "\ts.last_modified\n"
+                                                     "FROM\n"
+                                                     "\tyet_another_disk.system_items s\n"
+                                                     "WHERE\n"
+                                                     "    id = $1;",
+                                                     storages::postgres::Query::Name{"get_item_stats"}};
+        static auto &queryTime = metrics().Query("get_item_stats");
+        const QueryTimer timer(queryTime);
+        const auto res = cluster.Execute(hostType, query, id);
+        if (res.IsEmpty())
             return {};
+        const auto [itemId, type, size, files, maxDepth, lastModified] =
+                res.Front().As<std::string, std::string, long long, long long, int,
+                               std::optional<storages::postgres::TimePointTz>>();
+        formats::json::ValueBuilder stats;
+        stats["id"] = itemId;
+        stats["type"] = type;
+        stats["size"] = size;
+        stats["fileCount"] = files;
+        stats["maxDepth"] = maxDepth;
+        if (lastModified.has_value())
+            stats["lastModified"] = utils::datetime::Timestring(lastModified->GetUnderlying());
+        else
+            stats["lastModified"] = formats::json::Value{};
+        return stats.ExtractValue();
     }
 
-    nlohmann::json parseRes (const storages::postgres::ResultSet &res, const std::string &resId){
-        std::unordered_map<std::string, nlohmann::json> resultElems;
-        std::vector<std::string> folderIds;
-        for(const auto& elem: res){
-            const auto elemId = getStringFromField(elem["id_string"]);
-            const auto type = getStringFromField(elem["item_type"]);
-            auto subRes = parseRow(elem);
-            if(subRes.contains("parentId") && type == kFile){
-                resultElems[subRes["parentId"]]["children"].push_back(subRes);
-            }
-            if(type == kFolder){
-                folderIds.push_back(elemId);
-            }
-            resultElems[elemId] = std::move(subRes);
+    std::optional<storages::postgres::TimePointTz> parseDate(const std::string &value) {
+        if (value.empty())
+            return {};
+        try {
+            return storages::postgres::TimePointTz{utils::datetime::Stringtime(value)};
+        } catch (...) {
+            return {};
         }
-        std::reverse(folderIds.begin(), folderIds.end());
-        for(const auto& id: folderIds){
-            const auto elemType = resultElems[id]["type"].get<std::string>();
-            if(elemType == kFile)
-                continue;
-            if(!resultElems[id]["parentId"].is_null()){
-                resultElems[resultElems[id]["parentId"].get<std::string>()]["children"].push_back(resultElems[id]);
+    }
+
+    bool writeItemAndChildren(const boost::uuids::uuid &uid, const SubtreeQuery &query,
+                              storages::postgres::Transaction &trx, SubtreeWriter &writer){
+        // Ordering by path lists the subtree depth-first with every folder
+        // right before its contents, so it is written out while the portal
+        // is read and only one batch of rows is held at a time. An unpaged
+        // subtree without a depth limit is read in one pass over the path
+        // index.
+        const static storages::postgres::Query wholeSubtreeQuery{"SELECT s.id_string, p.id_string AS parent_string, s.item_type::text, s.url, s.item_size,\n"
+                                                                 "       s.\"date-time\", array_length(s.path, 1) - r.level AS depth,\n"
+                                                                 "       false AS has_more, false AS children_omitted\n"
+                                                                 "FROM (SELECT array_length(path, 1) AS level\n"
+                                                                 "      FROM yet_another_disk.system_items\n"
+                                                                 "      WHERE id = $1) r,\n"
+                                                                 "     yet_another_disk.system_items s\n"
+                                                                 "   LEFT JOIN yet_another_disk.system_items p ON p.id = s.parent_id\n"
+                                                                 "WHERE s.path @> ARRAY[$1]\n"
+                                                                 "ORDER BY s.path;",
+                                                                 storages::postgres::Query::Name{"select_whole_subtree"}};
+        // Only the requested page of children is expanded, level by level
+        // through the (parent_id, id) index and no deeper than the requested
+        // depth. Folders at the limit only check that a child exists.
+        const static storages::postgres::Query subtreeQuery{"WITH RECURSIVE page AS (\n"
+                                                            "   SELECT c.id\n"
+                                                            "   FROM yet_another_disk.system_items c\n"
+                                                            "   WHERE c.parent_id = $1 AND c.id > $3 AND $2 >= 1\n"
+                                                            "   ORDER BY c.id\n"
+                                                            "   LIMIT $4\n"
+                                                            "), below (id, depth) AS (\n"
+                                                            "   SELECT id, 1 FROM page\n"
+                                                            "   UNION ALL\n"
+                                                            "   SELECT c.id, b.depth + 1\n"
+                                                            "   FROM below b\n"
+                                                            "      JOIN yet_another_disk.system_items c ON c.parent_id = b.id\n"
+                                                            "   WHERE b.depth < $2\n"
+                                                            "), subtree (id, depth) AS (\n"
+                                                            "   SELECT $1, 0\n"
+                                                            "   UNION ALL\n"
+                                                            "   SELECT id, depth FROM below\n"
+                                                            ")\n"
+                                                            "SELECT s.id_string, p.id_string AS parent_string, s.item_type::text, s.url, s.item_size,\n"
+                                                            "       s.\"date-time\", t.depth,\n"
+                                                            "       CASE WHEN $4 IS NULL OR $2 < 1 THEN false\n"
+                                                            "            ELSE (SELECT count(*) FROM (\n"
+                                                            "                      SELECT 1 FROM yet_another_disk.system_items c\n"
+                                                            "                      WHERE c.parent_id = $1 AND c.id > $3\n"
+                                                            "                      ORDER BY c.id LIMIT $4 + 1) more) > $4\n"
+                                                            "       END AS has_more,\n"
+                                                            "       t.depth = $2 AND s.item_type = 'FOLDER'\n"
+                                                            "           AND EXISTS (SELECT 1 FROM yet_another_disk.system_items c WHERE c.parent_id = s.id)\n"
+                                                            "           AS children_omitted\n"
+                                                            "FROM subtree t\n"
+                                                            "   JOIN yet_another_disk.system_items s ON s.id = t.id\n"
+                                                            "   LEFT JOIN yet_another_disk.system_items p ON p.id = s.parent_id\n"
+                                                            "ORDER BY s.path;",
+                                                            storages::postgres::Query::Name{"select_subtree"}};
+        constexpr std::uint32_t kPortalBatch = 1000;
+
+        const int depthLimit = static_cast<int>(std::min<std::size_t>(query.maxDepth, std::numeric_limits<int>::max()));
+        std::optional<long long> limit;
+        if (query.limit.has_value())
+            limit = static_cast<long long>(query.limit.value());
+        // Rows are written out between fetches, so each fetch is timed on its own.
+        static auto &openTime = metrics().Query("subtree_open");
+        static auto &fetchTime = metrics().Query("subtree_fetch");
+        auto portal = [&] {
+            const QueryTimer timer(openTime);
+            if (query.maxDepth == kUnlimitedDepth && !query.limit.has_value() && !query.after.has_value())
+                return trx.MakePortal(wholeSubtreeQuery, uid);
+            return trx.MakePortal(subtreeQuery, uid, depthLimit,
+                                  query.after.value_or(boost::uuids::nil_uuid()), limit);
+        }();
+        bool found = false;
+        bool hasMore = false;
+        std::string lastChild;
+        while (!portal.Done()) {
+            const auto res = [&] {
+                const QueryTimer timer(fetchTime);
+                return portal.Fetch(kPortalBatch);
+            }();
+            for (auto row: res.AsSetOf<SubtreeRow>(storages::postgres::kRowTag)) {
+                const auto date = utils::datetime::Timestring(row.date.GetUnderlying());
+                if (row.depth == 0)
+                    hasMore = row.hasMore;
+                else if (row.depth == 1)
+                    lastChild = row.id;
+                writer.Add(row.depth, NodeView{row.id, row.parentId, row.type, row.url, row.size, date,
+                                               row.childrenOmitted});
+                found = true;
             }
+            if (res.IsEmpty())
+                break;
         }
-        return resultElems[resId];
+        if (hasMore)
+            writer.SetNext(lastChild);
+        return found;
     }
 
-    nlohmann::json parseRow(const storages::postgres::Row &row){
-        const auto id = getStringFromField(row["id_string"]);
-        const auto type = getStringFromField(row["item_type"]);
-        const auto size = row["item_size"].As<long long>();
-        const auto datePg = row["date-time"].As<storages::postgres::TimePointTz>();
+    SubtreeWriter::SubtreeWriter(Sink sink, std::size_t chunkSize)
+            : sink_(std::move(sink)), chunkSize_(chunkSize) {
+        buffer_.reserve(chunkSize_);
+    }
 
-        auto dateToParse = datePg.GetUnderlying();
-        const auto date = utils::datetime::Timestring(dateToParse);
+    void SubtreeWriter::Add(std::size_t depth, const NodeView &node) {
+        ++nodeCount_;
+        while (open_.size() > depth) {
+            Close();
+        }
+        if (!open_.empty()) {
+            if (open_.back())
+                buffer_ += ',';
+            open_.back() = true;
+        }
 
-        std::optional<std::string> url;
-        createOptional(row["url"], url);
+        buffer_ += "{\"id\":";
+        AppendString(node.id);
+        buffer_ += ",\"type\":";
+        AppendString(node.type);
+        buffer_ += ",\"size\":";
+        buffer_ += std::to_string(node.size);
+        buffer_ += ",\"date\":";
+        AppendString(node.date);
+        buffer_ += ",\"parentId\":";
+        if (node.parentId.has_value())
+            AppendString(node.parentId.value());
+        else
+            buffer_ += "null";
+        buffer_ += ",\"url\":";
+        if (node.url.has_value())
+            AppendString(node.url.value());
+        else
+            buffer_ += "null";
+        buffer_ += ",\"children\":";
 
-        std::optional<std::string> parentId;
-        createOptional(row["parent_string"], parentId);
+        if (node.type == kFolder && !node.childrenOmitted) {
+            buffer_ += '[';
+            open_.push_back(false);
+        } else {
+            buffer_ += "null}";
+        }
+        Flush();
+    }
 
-        nlohmann::json jsonRes = {
-                {"id", id},
-                {"size", size},
-                {"date", date},
-                {"type", type}
-        };
+    void SubtreeWriter::SetNext(std::string_view next) {
+        next_ = std::string{next};
+    }
 
+    std::string SubtreeWriter::Finish() {
+        while (!open_.empty()) {
+            Close();
+        }
+        if (sink_ && !buffer_.empty()) {
+            sink_(std::move(buffer_));
+            buffer_.clear();
+        }
+        return std::move(buffer_);
+    }
 
-        auto addKey = [&jsonRes]<class T>(const std::string &key, std::optional<T> opt){
-            if(opt.has_value())
-                jsonRes[key] = opt.value();
-            else
-                jsonRes[key] = nullptr;
-        };
+    void SubtreeWriter::Close() {
+        buffer_ += ']';
+        if (open_.size() == 1 && next_.has_value()) {
+            buffer_ += ",\"next\":";
+            AppendString(next_.value());
+        }
+        buffer_ += '}';
+        open_.pop_back();
+    }
 
-        addKey("parentId", parentId);
-        addKey("url", url);
+    void SubtreeWriter::AppendString(std::string_view value) {
+        static constexpr char kHex[] = "0123456789abcdef";
+        buffer_ += '"';
+        for (const char c: value) {
+            switch (c) {
+                case '"': buffer_ += "\\\""; break;
+                case '\\': buffer_ += "\\\\"; break;
+                case '\b': buffer_ += "\\b"; break;
+                case '\f': buffer_ += "\\f"; break;
+                case '\n': buffer_ += "\\n"; break;
+                case '\r': buffer_ += "\\r"; break;
+                case '\t': buffer_ += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        buffer_ += "\\u00";
+                        buffer_ += kHex[(c >> 4) & 0xf];
+                        buffer_ += kHex[c & 0xf];
+                    } else {
+                        buffer_ += c;
+                    }
+            }
+        }
+        buffer_ += '"';
+    }
 
+    void SubtreeWriter::Flush() {
+        if (!sink_ || buffer_.size() < chunkSize_)
+            return;
+        sink_(std::move(buffer_));
+        buffer_.clear();
+        buffer_.reserve(chunkSize_);
+    }
 
-        if (type == kFolder)
-            jsonRes["children"] = nlohmann::json::array();
-        else if(type == kFile)
-            jsonRes["children"] = nullptr;
+    std::optional<SubtreeQuery> parseSubtreeQuery(const std::string &depth, const std::string &limit,
+                                                  const std::string &after) {
+        auto parseCount = [](const std::string &arg) -> std::optional<std::size_t> {
+            try {
+                std::size_t parsed = 0;
+                const auto res = std::stoll(arg, &parsed);
+                if (parsed != arg.size() || res < 0)
+                    return {};
+                return static_cast<std::size_t>(res);
+            } catch (const std::exception &) {
+                return {};
+            }
+        };
 
-        return jsonRes;
+        SubtreeQuery res;
+        if (!depth.empty()) {
+            const auto parsed = parseCount(depth);
+            if (!parsed.has_value())
+                return {};
+            res.maxDepth = parsed.value();
+        }
+        if (!limit.empty()) {
+            res.limit = parseCount(limit);
+            if (!res.limit.has_value() || res.limit.value() == 0)
+                return {};
+        }
+        if (!after.empty())
+            res.after = uuidGen(after);
+        return res;
     }
 
-    template <typename T>
-    void createOptional (const storages::postgres::Field &elem, std::optional<T> &res){
-        if(elem.IsNull())
-            res = std::nullopt;
-        else if(std::is_same<T, std::string>())
-            res = getStringFromField(elem);
-        else
-            res = elem.As<T>();
+    storages::postgres::ClusterHostType readHostType(const server::http::HttpRequest &request) {
+        if (request.GetArg("consistency") == "strong")
+            return storages::postgres::ClusterHostType::kMaster;
+        return storages::postgres::ClusterHostType::kSlave;
     }
 
     formats::json::Value notFound(const server::http::HttpRequest &request){
@@ -408,26 +1319,74 @@ namespace yet_another_disk {
     void AppendService(components::ComponentList &component_list) {
         component_list.Append<components::Postgres>("postgres-db-1");
         component_list.Append<clients::dns::Component>();
+        component_list.Append<MetricsExporter>();
+        component_list.Append<TreeCache>();
         component_list.Append<Imports>();
+        component_list.Append<BulkImports>();
         component_list.Append<Nodes>();
         component_list.Append<Delete>();
+        component_list.Append<Updates>();
+        component_list.Append<NodeHistory>();
+        component_list.Append<NodeStats>();
+        component_list.Append<HistoryRetention>();
+        component_list.Append<SizeReconciler>();
     }
 
-    void deleteElemById(const boost::uuids::uuid &id, storages::postgres::Transaction &trx) {
-        const std::string query = "WITH RECURSIVE r AS (\n"
-                                  "   SELECT *\n"
-                                  "   FROM yet_another_disk.system_items\n"
-                                  "   WHERE id = $1\n"
-                                  "   UNION\n"
-                                  "   SELECT items.*\n"
-                                  "   FROM yet_another_disk.system_items as items\n"
-                                  "      JOIN r\n"
-                                  "          ON items.parent_id = r.id\n"
-                                  ")\n"
-                                  "DELETE\n"
-                                  "FROM yet_another_disk.system_items\n"
-                                  "WHERE id IN (SELECT id FROM r);";
-        trx.Execute(query, id);
+    std::optional<ItemPath> deleteSubtree(const boost::uuids::uuid &id,
+                                          const storages::postgres::TimePointTz &date,
+                                          storages::postgres::Transaction &trx) {
+        // One statement removes the subtree, its history rows go with it
+        // through the cascading foreign key, and takes its size and files away
+        // from every ancestor, which gets the date of the delete and a history
+        // row. Ancestors may become shallower, SizeReconciler recounts their
+        // depth. Marks of the removed folders are dropped with them. The
+        // root is recorded in deleted_items for the other instances' caches.
+        const static storages::postgres::Query query{"WITH target AS (\n"
+                                                     "   SELECT id, item_size, file_count, path\n"
+                                                     "   FROM yet_another_disk.system_items\n"
+                                                     "   WHERE id = $1\n"
+                                                     "), removed AS (\n"
+                                                     "   DELETE FROM yet_another_disk.system_items s\n"
+                                                     "   USING target t\n"
+                                                     "   WHERE s.path @> ARRAY[t.id]\n"
+                                                     "   RETURNING s.id\n"
+                                                     "), unmarked AS (\n"
+                                                     "   DELETE FROM yet_another_disk.dirty_folders d\n"
+                                                     "   USING removed r\n"
+                                                     "   WHERE d.id = r.id\n"
+                                                     "), tombstone AS (\n"
+                                                     "   INSERT INTO yet_another_disk.deleted_items (id)\n"
+                                                     "   SELECT id FROM target\n"
+                                                     "   ON CONFLICT (id) DO UPDATE SET deleted_at = now()\n"
+                                                     "), ancestors AS (\n"
+                                                     "   UPDATE yet_another_disk.system_items a\n"
+                                                     "       SET item_size = a.item_size - COALESCE(t.item_size, 0),\n"
+                                                     "           file_count = a.file_count - t.file_count,\n"
+                                                     "           last_modified = GREATEST(a.last_modified, $2),\n"
+                                                     "           \"date-time\" = $2\n"
+                                                     "   FROM target t\n"
+                                                     "   WHERE a.id = ANY(t.path) AND a.id <> t.id\n"
+                                                     "   RETURNING a.id, a.id_string, a.url,\n"
+                                                     "             a.parent_id, a.item_type, a.item_size, a.path\n"
+                                                     "), dirtied AS (\n"
+                                                     "   INSERT INTO yet_another_disk.dirty_folders (id, depth)\n"
+                                                     "   SELECT id, array_length(path, 1) FROM ancestors\n"
+                                                     "   ON CONFLICT (id) DO NOTHING\n"
+                                                     "), recorded AS (\n"
+                                                     "   INSERT INTO yet_another_disk.history\n"
+                                                     "   \t( item_id, id_string, parent_string, url, parent_id, item_type, item_size, \"date-time\")\n"
+                                                     "   SELECT a.id, a.id_string, p.id_string, a.url, a.parent_id, a.item_type, a.item_size, $2\n"
+                                                     "   FROM ancestors a\n"
+                                                     "       LEFT JOIN yet_another_disk.system_items p ON p.id = a.parent_id\n"
+                                                     ")\n"
+                                                     "SELECT path FROM target;",
+                                                     storages::postgres::Query::Name{"delete_subtree"}};
+        static auto &queryTime = metrics().Query("delete_subtree");
+        const QueryTimer timer(queryTime);
+        const auto res = trx.Execute(query, id, date);
+        if (res.IsEmpty())
+            return {};
+        return res.AsSingleRow<ItemPath>();
     }
 
 }  // namespace yet_another_disk
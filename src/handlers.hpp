@@ -1,12 +1,20 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
+#include <limits>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 #include <userver/storages/postgres/component.hpp>
+#include <userver/storages/postgres/exceptions.hpp>
+#include <userver/storages/postgres/query.hpp>
 #include <userver/components/component_list.hpp>
 #include <boost/uuid/uuid.hpp>            // uuid class
 #include <boost/uuid/uuid_generators.hpp> // generators
 #include <boost/uuid/uuid_io.hpp>         // streaming operators etc.
+#include <boost/functional/hash.hpp>
 #include <fmt/format.h>
 #include <userver/clients/dns/component.hpp>
 #include <userver/server/handlers/http_handler_base.hpp>
@@ -14,13 +22,145 @@
 #include <userver/storages/postgres/component.hpp>
 #include <userver/utils/datetime/date.hpp>
 #include <boost/algorithm/string.hpp>
-#include <nlohmann/json.hpp>
 using namespace userver;
 namespace yet_another_disk {
     const std::string kFolder = "FOLDER";
     const std::string kFile = "FILE";
     const boost::uuids::name_generator uuidGen(boost::uuids::ns::x500dn());
 
+    using UuidHash = boost::hash<boost::uuids::uuid>;
+
+    // Single element of an /imports batch, parsed and checked once on entry.
+    struct ImportItem {
+        std::string id;
+        boost::uuids::uuid uId;
+        std::string parentId;
+        std::optional<boost::uuids::uuid> uParent;
+        std::string type;
+        std::string url;
+        long long size;
+    };
+
+    using ItemPath = std::vector<boost::uuids::uuid>;
+
+    // State of an item as it is stored before the batch is applied.
+    struct StoredItem {
+        std::string type;
+        std::optional<boost::uuids::uuid> parentId;
+        long long size;
+        // Materialized path: ids from the root down to the item itself.
+        ItemPath path;
+        // Files in the subtree, 1 for a file.
+        long long files = 0;
+        // Levels from the item down to its deepest descendant, 0 for a file
+        // or an empty folder.
+        int maxDepth = 0;
+    };
+
+    using StoredItems = std::unordered_map<boost::uuids::uuid, StoredItem, UuidHash>;
+
+    // Change of the aggregates of a single folder brought by an import.
+    struct FolderDelta {
+        long long size = 0;
+        long long files = 0;
+        // Depth of the deepest subtree attached below the folder. Depth only
+        // grows through deltas, it shrinks when SizeReconciler recounts the
+        // folder.
+        int maxDepth = 0;
+    };
+
+    using FolderDeltas = std::unordered_map<boost::uuids::uuid, FolderDelta, UuidHash>;
+    using ParentMap = std::unordered_map<boost::uuids::uuid, std::optional<boost::uuids::uuid>, UuidHash>;
+
+    // Fields of a single node of a /nodes response.
+    struct NodeView {
+        std::string_view id;
+        std::optional<std::string_view> parentId;
+        std::string_view type;
+        std::optional<std::string_view> url;
+        long long size;
+        std::string_view date;
+        // A folder at the depth limit that has children, written with
+        // "children": null since they are not listed.
+        bool childrenOmitted = false;
+    };
+
+    // A node as the read queries select it: id_string, the parent's id_string,
+    // item_type, url, item_size and "date-time", mapped by position.
+    struct NodeRow {
+        std::string id;
+        std::optional<std::string> parentId;
+        std::string type;
+        std::optional<std::string> url;
+        long long size;
+        storages::postgres::TimePointTz date;
+    };
+
+    // The columns of NodeRow followed by the depth below the requested node,
+    // for the requested node whether more children follow the page, and
+    // whether the node has children below the depth limit.
+    struct SubtreeRow {
+        std::string id;
+        std::optional<std::string> parentId;
+        std::string type;
+        std::optional<std::string> url;
+        long long size;
+        storages::postgres::TimePointTz date;
+        int depth;
+        bool hasMore;
+        bool childrenOmitted;
+    };
+
+    constexpr std::size_t kUnlimitedDepth = std::numeric_limits<std::size_t>::max();
+
+    // Which part of a subtree a /nodes request asks for. Paging applies to
+    // the direct children of the requested node, ordered by uuid.
+    struct SubtreeQuery {
+        // Levels below the requested node to include.
+        std::size_t maxDepth = kUnlimitedDepth;
+        std::optional<std::size_t> limit;
+        // Children up to and including this one were returned by a previous page.
+        std::optional<boost::uuids::uuid> after;
+    };
+
+    // Writes a subtree as nested JSON from nodes coming in depth-first order,
+    // depth being counted from the subtree root. With a sink the output is
+    // handed over in chunks as it grows, so a subtree of any size is written
+    // with a bounded buffer.
+    class SubtreeWriter {
+    public:
+        using Sink = std::function<void(std::string &&chunk)>;
+
+        SubtreeWriter() = default;
+
+        SubtreeWriter(Sink sink, std::size_t chunkSize);
+
+        void Add(std::size_t depth, const NodeView &node);
+
+        // Cursor to continue the children of the root with, written into
+        // the root as "next" when it is closed.
+        void SetNext(std::string_view next);
+
+        // Closes every open folder and returns the output not handed to the sink.
+        std::string Finish();
+
+        std::size_t NodeCount() const { return nodeCount_; }
+
+    private:
+        void Close();
+
+        void AppendString(std::string_view value);
+
+        void Flush();
+
+        Sink sink_;
+        std::size_t chunkSize_ = 0;
+        std::string buffer_;
+        // One entry per open folder, from the root down: whether it has a child yet.
+        std::vector<bool> open_;
+        std::optional<std::string> next_;
+        std::size_t nodeCount_ = 0;
+    };
 
     bool checkFile(const formats::json::Value &elem);
 
@@ -29,35 +169,121 @@ namespace yet_another_disk {
     std::optional<std::map<std::string, formats::json::Value>> getJsonArgs(
             const formats::json::Value &request_json);
 
-    std::optional<storages::postgres::ResultSet> checkImport(const formats::json::Value &elem,
-                                                             storages::postgres::Transaction &trx);
+    std::optional<ImportItem> parseImportItem(const formats::json::Value &elem);
+
+    std::optional<std::vector<ImportItem>> parseImportItems(const formats::json::Value &items);
+
+    constexpr std::size_t kConflictAttempts = 5;
+    constexpr std::chrono::milliseconds kConflictBackoff{10};
+
+    // Counts a retry and sleeps for a random time that doubles with every attempt.
+    void backoffAfterConflict(std::size_t attempt);
+
+    // Runs `body`, which opens and commits its own transaction, again when
+    // the db rolls it back for a deadlock or a serialization failure, up to
+    // kConflictAttempts times.
+    template <typename Body>
+    auto retryOnConflict(Body &&body) {
+        for (std::size_t attempt = 1;; ++attempt) {
+            try {
+                return body();
+            } catch (const storages::postgres::TransactionRollback &) {
+                if (attempt == kConflictAttempts)
+                    throw;
+            }
+            backoffAfterConflict(attempt);
+        }
+    }
+
+    // Validates a batch of /imports and writes it, returns the ids of every
+    // row it changed or nothing if the batch is invalid. The caller commits.
+    std::optional<std::vector<boost::uuids::uuid>> importItems(const std::vector<ImportItem> &items,
+                                                               const storages::postgres::TimePointTz &date,
+                                                               storages::postgres::Transaction &trx);
+
+    std::vector<boost::uuids::uuid> collectReferencedIds(const std::vector<ImportItem> &items);
+
+    // With forUpdate the rows are locked in uuid order.
+    StoredItems getItemsByIds(const std::vector<boost::uuids::uuid> &ids,
+                              storages::postgres::Transaction &trx, bool forUpdate);
+
+    // Locks the given rows and all their ancestors, returns them all.
+    StoredItems lockItems(std::vector<boost::uuids::uuid> ids, storages::postgres::Transaction &trx);
+
+    bool validateImport(const std::vector<ImportItem> &items, const StoredItems &stored);
+
+    std::vector<ImportItem> dedupeImportItems(std::vector<ImportItem> items);
+
+    FolderDeltas collectParentDeltas(const std::vector<ImportItem> &items, const StoredItems &stored);
+
+    void insertItems(const std::vector<ImportItem> &items,
+                     const std::vector<ItemPath> &paths,
+                     const userver::storages::postgres::TimePointTz &date,
+                     storages::postgres::Transaction &trx);
 
     storages::postgres::ResultSet getItemById(const boost::uuids::uuid &id,
                                               storages::postgres::Transaction &trx);
 
-    std::optional<formats::json::Value> getItemAndChildren(const boost::uuids::uuid &uid, const std::string &id,
-                                              storages::postgres::Transaction &trx);
+    bool writeItemAndChildren(const boost::uuids::uuid &uid, const SubtreeQuery &query,
+                              storages::postgres::Transaction &trx, SubtreeWriter &writer);
+
+    ParentMap buildParentMap(const std::vector<ImportItem> &items, const StoredItems &stored);
+
+    std::optional<ItemPath> pathTo(const boost::uuids::uuid &id, const ParentMap &parents);
+
+    std::optional<std::vector<ItemPath>> buildPaths(const std::vector<ImportItem> &items, const ParentMap &parents);
+
+    std::string formatPath(const ItemPath &path);
+
+    std::vector<boost::uuids::uuid> collectMovedFolders(const std::vector<ImportItem> &items,
+                                                        const std::vector<ItemPath> &paths,
+                                                        const StoredItems &stored);
 
-    nlohmann::json parseRes (const storages::postgres::ResultSet &res, const std::string &resId);
+    void updateDescendantPaths(const std::vector<boost::uuids::uuid> &moved,
+                               storages::postgres::Transaction &trx);
 
-    nlohmann::json parseRow(const storages::postgres::Row &row);
+    FolderDeltas spreadDeltas(const FolderDeltas &parentDeltas, const ParentMap &parents);
 
-    void updateParent(const boost::uuids::uuid &id, long long changeSize, storages::postgres::TimePointTz,
-                      storages::postgres::Transaction &trx);
+    void applyFolderDeltas(const FolderDeltas &deltas, storages::postgres::TimePointTz date,
+                           storages::postgres::Transaction &trx);
 
-    void insertItem(const formats::json::Value &elem,
-                    const userver::storages::postgres::TimePointTz &date,
-                    storages::postgres::Transaction &trx);
+    // Files changed within the 24 hours up to and including `date`.
+    formats::json::Value getUpdates(const storages::postgres::TimePointTz &date,
+                                    storages::postgres::Cluster &cluster,
+                                    storages::postgres::ClusterHostType hostType);
 
-    std::string getStringFromField(const storages::postgres::Field &elem);
+    // History of an item within [dateStart, dateEnd), either bound may be
+    // absent. Empty if there is no such item.
+    std::optional<formats::json::Value> getItemHistory(const boost::uuids::uuid &id,
+                                                       const std::optional<storages::postgres::TimePointTz> &dateStart,
+                                                       const std::optional<storages::postgres::TimePointTz> &dateEnd,
+                                                       storages::postgres::Transaction &trx);
 
-    template <typename T>
-    void createOptional (const storages::postgres::Field &elem, std::optional<T> &res);
+    formats::json::Value historyRowToJson(const NodeRow &row);
+
+    // Size, file count, depth and last change of the subtree of an item,
+    // read from its own row. Empty if there is no such item.
+    std::optional<formats::json::Value> getItemStats(const boost::uuids::uuid &id,
+                                                     storages::postgres::Cluster &cluster,
+                                                     storages::postgres::ClusterHostType hostType);
+
+    // Parses an ISO 8601 date from a query argument, empty on malformed input.
+    std::optional<storages::postgres::TimePointTz> parseDate(const std::string &value);
+
+    // Parses the optional `depth`, `limit` and `after` query arguments.
+    std::optional<SubtreeQuery> parseSubtreeQuery(const std::string &depth, const std::string &limit,
+                                                  const std::string &after);
+
+    // The master for consistency=strong, a replica otherwise.
+    storages::postgres::ClusterHostType readHostType(const server::http::HttpRequest &request);
 
     formats::json::Value notFound(const server::http::HttpRequest &request);
 
-    void deleteElemById(const boost::uuids::uuid &id,
-                                              storages::postgres::Transaction &trx);
+    // Deletes the item with everything below it and fixes the sizes of its
+    // ancestors. Returns the path of the deleted item, empty if there was none.
+    std::optional<ItemPath> deleteSubtree(const boost::uuids::uuid &id,
+                                          const storages::postgres::TimePointTz &date,
+                                          storages::postgres::Transaction &trx);
 
     void AppendService(userver::components::ComponentList &component_list);
 
@@ -3,15 +3,314 @@
 //
 
 #include "handlers.hpp"
+#include "tree_cache.hpp"
 
 #include <cstdint>   // for std::uint64_t
 #include <iterator>  // for std::size
 #include <string_view>
 
 #include <benchmark/benchmark.h>
+#include <nlohmann/json.hpp>
 #include <userver/engine/run_standalone.hpp>
+#include <userver/formats/json/serialize.hpp>
+#include <userver/formats/json/value_builder.hpp>
 
-void HandlersBenchmark(benchmark::State& state) {
+namespace {
+
+    // Chain of `depth` folders with `files` files spread over its levels.
+    struct SyntheticImport {
+        yet_another_disk::ParentMap parents;
+        yet_another_disk::FolderDeltas parentDeltas;
+        std::int64_t perFileRows = 0;
+    };
+
+    SyntheticImport makeImport(std::int64_t depth, std::int64_t files) {
+        SyntheticImport res;
+        std::vector<boost::uuids::uuid> folders;
+        std::optional<boost::uuids::uuid> parent;
+        for (std::int64_t level = 0; level < depth; ++level) {
+            const auto id = yet_another_disk::uuidGen("folder-" + std::to_string(level));
+            res.parents.emplace(id, parent);
+            folders.push_back(id);
+            parent = id;
+        }
+        for (std::int64_t file = 0; file < files; ++file) {
+            const auto level = file % depth;
+            auto &delta = res.parentDeltas[folders[level]];
+            delta.size += 1;
+            delta.files += 1;
+            delta.maxDepth = 1;
+            // updateParent used to rewrite the whole chain for every file.
+            res.perFileRows += level + 1;
+        }
+        return res;
+    }
+
+    struct SyntheticNode {
+        std::size_t depth;
+        std::string id;
+        std::optional<std::string> parentId;
+        std::string type;
+        std::optional<std::string> url;
+        long long size;
+        std::string date;
+    };
+
+    // Depth-first listing of a tree of `depth` levels of folders where every
+    // folder holds `width` folders and the folders on the last level hold
+    // `files` files each.
+    std::vector<SyntheticNode> makeSubtree(std::int64_t width, std::int64_t depth, std::int64_t files) {
+        std::vector<SyntheticNode> res;
+        const std::string date = "2022-02-03T15:00:00+0000";
+        auto add = [&](auto &self, const std::optional<std::string> &parent, std::size_t level) -> void {
+            const auto id = "node-" + std::to_string(res.size());
+            res.push_back({level, id, parent, yet_another_disk::kFolder, std::nullopt, 0, date});
+            if (static_cast<std::int64_t>(level) + 1 == depth) {
+                for (std::int64_t i = 0; i < files; ++i) {
+                    const auto fileId = "node-" + std::to_string(res.size());
+                    res.push_back({level + 1, fileId, id, yet_another_disk::kFile, "/file/" + fileId, 128, date});
+                }
+                return;
+            }
+            for (std::int64_t i = 0; i < width; ++i) {
+                self(self, id, level + 1);
+            }
+        };
+        add(add, std::nullopt, 0);
+        return res;
+    }
+
+    // The tree from the arguments of a benchmark registered with treeShapes.
+    std::vector<SyntheticNode> makeSubtree(const benchmark::State &state) {
+        return makeSubtree(state.range(0), state.range(1), state.range(2));
+    }
+
+    // Trees from a dozen nodes up to about 100k: width 2 and 10, 2 and 4
+    // levels of folders, 1, 10 and 100 files in every folder of the last
+    // level.
+    void treeShapes(benchmark::internal::Benchmark *benchmark) {
+        benchmark->ArgNames({"width", "depth", "files"})
+                ->RangeMultiplier(10)
+                ->Ranges({{2, 10}, {2, 4}, {1, 100}});
+    }
+
+    // The former /nodes path: nlohmann tree with subtrees copied into their
+    // parents, pretty-printed, parsed back and serialized once more.
+    std::string legacySerialize(const std::vector<SyntheticNode> &nodes) {
+        std::unordered_map<std::string, nlohmann::json> elems;
+        for (auto node = nodes.rbegin(); node != nodes.rend(); ++node) {
+            nlohmann::json elem = {
+                    {"id", node->id},
+                    {"size", node->size},
+                    {"date", node->date},
+                    {"type", node->type},
+                    {"parentId", node->parentId.has_value() ? nlohmann::json(*node->parentId) : nullptr},
+                    {"url", node->url.has_value() ? nlohmann::json(*node->url) : nullptr},
+            };
+            if (node->type == yet_another_disk::kFolder)
+                elem["children"] = elems[node->id]["children"].is_null() ? nlohmann::json::array()
+                                                                           : elems[node->id]["children"];
+            else
+                elem["children"] = nullptr;
+            if (node->parentId.has_value())
+                elems[*node->parentId]["children"].push_back(elem);
+            elems[node->id] = std::move(elem);
+        }
+        const auto pretty = elems[nodes.front().id].dump(4);
+        return formats::json::ToString(formats::json::FromString(pretty));
+    }
+
+    yet_another_disk::TreeIndex makeTreeIndex(const std::vector<SyntheticNode> &nodes) {
+        yet_another_disk::TreePatch patch{yet_another_disk::TreeIndex{}};
+        for (const auto &node: nodes) {
+            std::optional<boost::uuids::uuid> parent;
+            if (node.parentId.has_value())
+                parent = yet_another_disk::uuidGen(*node.parentId);
+            patch.Upsert(yet_another_disk::uuidGen(node.id), parent,
+                         yet_another_disk::NodeView{node.id, node.parentId, node.type,
+                                                    node.url, node.size, node.date});
+        }
+        return patch.Finish();
+    }
+
+    // /imports body holding the nodes of makeSubtree, parents before children.
+    std::string makeImportBody(const std::vector<SyntheticNode> &nodes) {
+        formats::json::ValueBuilder items(formats::json::Type::kArray);
+        for (const auto &node: nodes) {
+            formats::json::ValueBuilder item;
+            item["id"] = node.id;
+            item["type"] = node.type;
+            if (node.parentId.has_value())
+                item["parentId"] = *node.parentId;
+            if (node.url.has_value()) {
+                item["url"] = *node.url;
+                item["size"] = node.size;
+            }
+            items.PushBack(std::move(item));
+        }
+        formats::json::ValueBuilder body;
+        body["items"] = std::move(items);
+        body["updateDate"] = nodes.front().date;
+        return formats::json::ToString(body.ExtractValue());
+    }
+
+}  // namespace
+
+// CPU-only paths on synthetic trees. The same requests against a running
+// service and PostgreSQL are measured by the load harness in tests/load,
+// see `make perf`.
+
+void UuidGenBenchmark(benchmark::State& state) {
+    std::vector<std::string> ids;
+    for (std::int64_t i = 0; i < state.range(0); ++i) {
+        ids.push_back("069cb8d7-bbdd-47d3-ad8f-82ef4c26" + std::to_string(1000 + i));
+    }
+    for (auto _: state) {
+        for (const auto &id: ids) {
+            benchmark::DoNotOptimize(yet_another_disk::uuidGen(id));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(UuidGenBenchmark)
+        ->RangeMultiplier(10)
+        ->Range(1, 1000);
+
+void CheckItemBenchmark(benchmark::State& state) {
+    const auto body = formats::json::FromString(makeImportBody(makeSubtree(state)));
+    const auto items = body["items"];
+    for (auto _: state) {
+        for (const auto &elem: items) {
+            if (elem["type"].As<std::string>() == yet_another_disk::kFile)
+                benchmark::DoNotOptimize(yet_another_disk::checkFile(elem));
+            else
+                benchmark::DoNotOptimize(yet_another_disk::checkFolder(elem));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * items.GetSize());
+}
+
+BENCHMARK(CheckItemBenchmark)->Apply(treeShapes);
+
+void ParseImportBenchmark(benchmark::State& state) {
+    const auto body = makeImportBody(makeSubtree(state));
+    std::size_t items = 0;
+    for (auto _: state) {
+        const auto json = formats::json::FromString(body);
+        const auto parsed = yet_another_disk::parseImportItems(json["items"]);
+        items = parsed.value().size();
+        benchmark::DoNotOptimize(parsed);
+    }
+    state.SetItemsProcessed(state.iterations() * items);
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+
+BENCHMARK(ParseImportBenchmark)->Apply(treeShapes);
+
+// Everything /imports does with a parsed batch before touching the db again,
+// as for a batch that creates the whole tree.
+void PrepareImportBenchmark(benchmark::State& state) {
+    const auto body = formats::json::FromString(makeImportBody(makeSubtree(state)));
+    const auto items = yet_another_disk::parseImportItems(body["items"]).value();
+    const yet_another_disk::StoredItems stored;
+    for (auto _: state) {
+        if (!yet_another_disk::validateImport(items, stored))
+            state.SkipWithError("synthetic import is invalid");
+        const auto batch = yet_another_disk::dedupeImportItems(items);
+        const auto parents = yet_another_disk::buildParentMap(batch, stored);
+        const auto paths = yet_another_disk::buildPaths(batch, parents);
+        const auto deltas = yet_another_disk::spreadDeltas(
+                yet_another_disk::collectParentDeltas(batch, stored), parents);
+        benchmark::DoNotOptimize(paths);
+        benchmark::DoNotOptimize(deltas);
+    }
+    state.SetItemsProcessed(state.iterations() * items.size());
+}
+
+BENCHMARK(PrepareImportBenchmark)->Apply(treeShapes);
+
+void LegacySerializeBenchmark(benchmark::State& state) {
+    const auto nodes = makeSubtree(state);
+    for (auto _: state) {
+        benchmark::DoNotOptimize(legacySerialize(nodes));
+    }
+    state.counters["nodes"] = nodes.size();
+}
+
+BENCHMARK(LegacySerializeBenchmark)->Apply(treeShapes);
+
+void SubtreeWriterBenchmark(benchmark::State& state) {
+    const auto nodes = makeSubtree(state);
+    for (auto _: state) {
+        yet_another_disk::SubtreeWriter writer;
+        for (const auto &node: nodes) {
+            writer.Add(node.depth, yet_another_disk::NodeView{node.id, node.parentId, node.type,
+                                                              node.url, node.size, node.date});
+        }
+        benchmark::DoNotOptimize(writer.Finish());
+    }
+    state.counters["nodes"] = nodes.size();
+}
+
+BENCHMARK(SubtreeWriterBenchmark)->Apply(treeShapes);
+
+void TreeIndexBuildBenchmark(benchmark::State& state) {
+    const auto nodes = makeSubtree(state);
+    for (auto _: state) {
+        benchmark::DoNotOptimize(makeTreeIndex(nodes));
+    }
+    state.counters["nodes"] = nodes.size();
+}
+
+BENCHMARK(TreeIndexBuildBenchmark)->Apply(treeShapes);
+
+void TreeIndexWriteBenchmark(benchmark::State& state) {
+    const auto nodes = makeSubtree(state);
+    const auto index = makeTreeIndex(nodes);
+    const auto root = yet_another_disk::uuidGen(nodes.front().id);
+    for (auto _: state) {
+        yet_another_disk::SubtreeWriter writer;
+        yet_another_disk::writeSubtree(index, root, {}, writer);
+        benchmark::DoNotOptimize(writer.Finish());
+    }
+    state.counters["nodes"] = nodes.size();
+}
+
+BENCHMARK(TreeIndexWriteBenchmark)->Apply(treeShapes);
+
+// Applying a one-file import to a built index, the cost paid on the request
+// path. Should stay flat as the tree grows.
+void TreeIndexPatchBenchmark(benchmark::State& state) {
+    const auto nodes = makeSubtree(state);
+    const auto index = makeTreeIndex(nodes);
+    const auto &file = nodes.back();
+    const auto parent = yet_another_disk::uuidGen(*file.parentId);
+    const auto id = yet_another_disk::uuidGen(file.id);
+    for (auto _: state) {
+        yet_another_disk::TreePatch patch{index};
+        patch.Upsert(id, parent, yet_another_disk::NodeView{file.id, file.parentId, file.type,
+                                                            file.url, file.size + 1, file.date});
+        benchmark::DoNotOptimize(patch.Finish());
+    }
+    state.counters["nodes"] = nodes.size();
+}
+
+BENCHMARK(TreeIndexPatchBenchmark)->Apply(treeShapes);
+
+void SpreadDeltasBenchmark(benchmark::State& state) {
+    const auto import = makeImport(state.range(0), state.range(1));
+    std::size_t rowsWritten = 0;
+    for (auto _: state) {
+        const auto deltas = yet_another_disk::spreadDeltas(import.parentDeltas, import.parents);
+        rowsWritten = deltas.size();
+        benchmark::DoNotOptimize(deltas);
+    }
+    state.counters["rows_per_import"] = rowsWritten;
+    state.counters["rows_per_import_per_file"] = import.perFileRows;
 }
 
-BENCHMARK(HandlersBenchmark);
\ No newline at end of file
+BENCHMARK(SpreadDeltasBenchmark)
+        ->ArgNames({"depth", "files"})
+        ->RangeMultiplier(10)
+        ->Ranges({{4, 20}, {100, 10000}});
@@ -0,0 +1,58 @@
+#include "history_retention.hpp"
+
+#include <userver/logging/log.hpp>
+#include <userver/utils/datetime.hpp>
+
+namespace yet_another_disk {
+
+    HistoryRetention::HistoryRetention(const components::ComponentConfig &config,
+                                       const components::ComponentContext &component_context)
+            : components::LoggableComponentBase(config, component_context),
+              pg_cluster_(
+                      component_context
+                              .FindComponent<components::Postgres>("postgres-db-1")
+                              .GetCluster()),
+              retention_(config["retention"].As<std::chrono::seconds>()),
+              deletedRetention_(config["deleted-items-retention"].As<std::chrono::seconds>(std::chrono::hours{24})),
+              precreateMonths_(config["precreate-months"].As<int>(3)) {
+        const auto interval = config["check-interval"].As<std::chrono::seconds>();
+        // The first run makes the partitions at startup, before imports.
+        task_.Start(std::string{kName},
+                    utils::PeriodicTask::Settings{interval, {utils::PeriodicTask::Flags::kNow}}, [this] {
+            CreateUpcoming();
+            DropExpired();
+            PruneDeleted();
+        });
+    }
+
+    HistoryRetention::~HistoryRetention() {
+        task_.Stop();
+    }
+
+    void HistoryRetention::CreateUpcoming() {
+        const static storages::postgres::Query query{"SELECT yet_another_disk.create_history_partition(now() + n * interval '1 month')\n"
+                                                     "FROM generate_series(0, $1) n;",
+                                                     storages::postgres::Query::Name{"create_history_partitions"}};
+        pg_cluster_->Execute(storages::postgres::ClusterHostType::kMaster, query, precreateMonths_);
+    }
+
+    void HistoryRetention::DropExpired() {
+        const static storages::postgres::Query query{"SELECT yet_another_disk.drop_history_partitions($1);",
+                                                     storages::postgres::Query::Name{"drop_history_partitions"}};
+        const storages::postgres::TimePointTz cutoff{utils::datetime::Now() - retention_};
+        const auto res = pg_cluster_->Execute(storages::postgres::ClusterHostType::kMaster, query, cutoff);
+        const auto dropped = res.AsSingleRow<int>();
+        if (dropped > 0)
+            LOG_INFO() << "Dropped " << dropped << " history partitions";
+    }
+
+    void HistoryRetention::PruneDeleted() {
+        const static storages::postgres::Query query{"DELETE FROM yet_another_disk.deleted_items WHERE deleted_at < $1;",
+                                                     storages::postgres::Query::Name{"prune_deleted_items"}};
+        const storages::postgres::TimePointTz cutoff{utils::datetime::Now() - deletedRetention_};
+        const auto res = pg_cluster_->Execute(storages::postgres::ClusterHostType::kMaster, query, cutoff);
+        if (res.RowsAffected() > 0)
+            LOG_INFO() << "Pruned " << res.RowsAffected() << " deleted items";
+    }
+
+}  // namespace yet_another_disk
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "handlers.hpp"
+
+#include <chrono>
+
+#include <userver/components/loggable_component_base.hpp>
+#include <userver/utils/periodic_task.hpp>
+
+namespace yet_another_disk {
+
+    // Keeps the monthly history partitions, checked every `check-interval`:
+    // creates the partitions of this month and the next `precreate-months`
+    // ahead of the writes, and drops the ones that ended more than
+    // `retention` ago. Writes never run DDL, rows dated outside every
+    // partition go to the default one. Dropping a partition is a catalog
+    // change, so old history goes away without a DELETE or a vacuum. The
+    // same task prunes deleted_items rows older than
+    // `deleted-items-retention`, which only incremental TreeCache updates
+    // read and which must outlive the full update interval.
+    class HistoryRetention final : public components::LoggableComponentBase {
+    public:
+        static constexpr std::string_view kName = "history-retention";
+
+        HistoryRetention(const components::ComponentConfig &config,
+                         const components::ComponentContext &component_context);
+
+        ~HistoryRetention() override;
+
+    private:
+        void CreateUpcoming();
+
+        void DropExpired();
+
+        void PruneDeleted();
+
+        storages::postgres::ClusterPtr pg_cluster_;
+        std::chrono::seconds retention_;
+        std::chrono::seconds deletedRetention_;
+        int precreateMonths_;
+        utils::PeriodicTask task_;
+    };
+
+}  // namespace yet_another_disk
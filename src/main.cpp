@@ -1,6 +1,7 @@
 #include <userver/clients/http/component.hpp>
 #include <userver/components/minimal_server_component_list.hpp>
 #include <userver/server/handlers/ping.hpp>
+#include <userver/server/handlers/server_monitor.hpp>
 #include <userver/server/handlers/tests_control.hpp>
 #include <userver/testsuite/testsuite_support.hpp>
 #include <userver/utils/daemon_run.hpp>
@@ -10,6 +11,7 @@
 int main(int argc, char *argv[]) {
     auto component_list = userver::components::MinimalServerComponentList()
             .Append<userver::server::handlers::Ping>()
+            .Append<userver::server::handlers::ServerMonitor>()
             .Append<userver::components::TestsuiteSupport>()
             .Append<userver::components::HttpClient>()
             .Append<userver::server::handlers::TestsControl>();
@@ -0,0 +1,91 @@
+#include "metrics.hpp"
+
+#include <mutex>
+
+#include <userver/components/statistics_storage.hpp>
+#include <userver/engine/task/local_variable.hpp>
+#include <userver/utils/statistics/percentile_format_json.hpp>
+
+namespace yet_another_disk {
+
+    namespace {
+
+        engine::TaskLocalVariable<std::uint64_t> requestRoundTrips;
+
+    }  // namespace
+
+    void Distribution::Account(std::uint64_t value) {
+        values_.GetCurrentCounter().Account(value);
+    }
+
+    formats::json::ValueBuilder Distribution::ToJson() const {
+        return utils::statistics::PercentileToJson(values_.GetStatsForPeriod(), {50, 90, 99, 99.9});
+    }
+
+    HandlerMetrics &DiskMetrics::Handler(std::string_view name) {
+        std::lock_guard lock(mutex_);
+        auto it = handlers_.find(name);
+        if (it == handlers_.end())
+            it = handlers_.try_emplace(std::string{name}).first;
+        return it->second;
+    }
+
+    Distribution &DiskMetrics::Query(std::string_view name) {
+        std::lock_guard lock(mutex_);
+        auto it = queries_.find(name);
+        if (it == queries_.end())
+            it = queries_.try_emplace(std::string{name}).first;
+        return it->second;
+    }
+
+    formats::json::ValueBuilder DiskMetrics::ToJson() const {
+        std::lock_guard lock(mutex_);
+        formats::json::ValueBuilder res;
+        for (const auto &[name, handler]: handlers_) {
+            res["handlers"][name]["db-round-trips"] = handler.roundTrips.ToJson();
+            res["handlers"][name]["items"] = handler.items.ToJson();
+        }
+        for (const auto &[name, query]: queries_) {
+            res["queries"][name]["timings-ms"] = query.ToJson();
+        }
+        res["conflict-retries"] = conflictRetries.load();
+        return res;
+    }
+
+    DiskMetrics &metrics() {
+        static DiskMetrics instance;
+        return instance;
+    }
+
+    RequestScope::RequestScope(HandlerMetrics &handler) : handler_(handler) {
+        *requestRoundTrips = 0;
+    }
+
+    RequestScope::~RequestScope() {
+        handler_.roundTrips.Account(*requestRoundTrips);
+    }
+
+    QueryTimer::QueryTimer(Distribution &query)
+            : query_(query), start_(std::chrono::steady_clock::now()) {}
+
+    QueryTimer::~QueryTimer() {
+        const auto elapsed = std::chrono::steady_clock::now() - start_;
+        query_.Account(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+        ++*requestRoundTrips;
+    }
+
+    MetricsExporter::MetricsExporter(const components::ComponentConfig &config,
+                                     const components::ComponentContext &component_context)
+            : components::LoggableComponentBase(config, component_context) {
+        statisticsEntry_ = component_context.FindComponent<components::StatisticsStorage>()
+                .GetStorage()
+                .RegisterExtender("yet-another-disk", [](const auto &) {
+                    return metrics().ToJson();
+                });
+    }
+
+    MetricsExporter::~MetricsExporter() {
+        statisticsEntry_.Unregister();
+    }
+
+}  // namespace yet_another_disk
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include <userver/components/loggable_component_base.hpp>
+#include <userver/engine/mutex.hpp>
+#include <userver/formats/json/value_builder.hpp>
+#include <userver/utils/statistics/percentile.hpp>
+#include <userver/utils/statistics/recentperiod.hpp>
+#include <userver/utils/statistics/storage.hpp>
+
+using namespace userver;
+namespace yet_another_disk {
+
+    // Distribution of a value over the last minute: exact up to 2048, then
+    // in buckets of 100 up to 14048, larger values count as the largest.
+    class Distribution {
+    public:
+        void Account(std::uint64_t value);
+
+        formats::json::ValueBuilder ToJson() const;
+
+    private:
+        using Percentile = utils::statistics::Percentile<2048, std::uint32_t, 120, 100>;
+
+        utils::statistics::RecentPeriod<Percentile, Percentile> values_;
+    };
+
+    struct HandlerMetrics {
+        // Statements sent to the db while serving one request, including the
+        // tree cache refresh after a write. BEGIN and COMMIT are not counted.
+        Distribution roundTrips;
+        // Items in an /imports batch or nodes written by /nodes.
+        Distribution items;
+    };
+
+    // Process-wide metrics. Entries are created on first use and live as long
+    // as the process, so references to them may be kept.
+    class DiskMetrics {
+    public:
+        HandlerMetrics &Handler(std::string_view name);
+
+        // Time of a single statement, in milliseconds.
+        Distribution &Query(std::string_view name);
+
+        formats::json::ValueBuilder ToJson() const;
+
+        // Transactions run again after a deadlock or a serialization failure.
+        std::atomic<std::uint64_t> conflictRetries{0};
+
+    private:
+        mutable engine::Mutex mutex_;
+        std::map<std::string, HandlerMetrics, std::less<>> handlers_;
+        std::map<std::string, Distribution, std::less<>> queries_;
+    };
+
+    DiskMetrics &metrics();
+
+    // Counts the db round trips of the request handled by the current task
+    // and accounts them when the request is done.
+    class RequestScope {
+    public:
+        explicit RequestScope(HandlerMetrics &handler);
+
+        ~RequestScope();
+
+    private:
+        HandlerMetrics &handler_;
+    };
+
+    // Times one statement and counts it as a round trip of the current request.
+    class QueryTimer {
+    public:
+        explicit QueryTimer(Distribution &query);
+
+        ~QueryTimer();
+
+    private:
+        Distribution &query_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // Exports metrics() through the statistics storage under "yet-another-disk".
+    class MetricsExporter final : public components::LoggableComponentBase {
+    public:
+        static constexpr std::string_view kName = "metrics-exporter";
+
+        MetricsExporter(const components::ComponentConfig &config,
+                        const components::ComponentContext &component_context);
+
+        ~MetricsExporter() override;
+
+    private:
+        utils::statistics::Entry statisticsEntry_;
+    };
+
+}  // namespace yet_another_disk
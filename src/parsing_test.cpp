@@ -1,7 +1,201 @@
 #include "handlers.hpp"
+#include "tree_cache.hpp"
 
+#include <userver/formats/json/serialize.hpp>
 #include <userver/utest/utest.hpp>
 
 UTEST(CheckFile, Basic) {
 
 }
+
+namespace {
+
+    yet_another_disk::ImportItem makeItem(const std::string &json) {
+        return yet_another_disk::parseImportItem(formats::json::FromString(json)).value();
+    }
+
+}  // namespace
+
+UTEST(ValidateImport, ParentFromSameBatch) {
+    const std::vector<yet_another_disk::ImportItem> items = {
+            makeItem(R"({"id": "a", "type": "FOLDER"})"),
+            makeItem(R"({"id": "b", "type": "FILE", "parentId": "a", "url": "/b", "size": 1})"),
+    };
+    EXPECT_TRUE(yet_another_disk::validateImport(items, {}));
+
+    const std::vector<yet_another_disk::ImportItem> reversed = {items[1], items[0]};
+    EXPECT_FALSE(yet_another_disk::validateImport(reversed, {}));
+}
+
+UTEST(ValidateImport, TypeChange) {
+    yet_another_disk::StoredItems stored;
+    stored.emplace(yet_another_disk::uuidGen("a"), yet_another_disk::StoredItem{"FILE", std::nullopt, 10});
+    const std::vector<yet_another_disk::ImportItem> items = {
+            makeItem(R"({"id": "a", "type": "FOLDER"})"),
+    };
+    EXPECT_FALSE(yet_another_disk::validateImport(items, stored));
+}
+
+UTEST(CollectParentDeltas, MoveFolder) {
+    const auto root = yet_another_disk::uuidGen("root");
+    const auto a = yet_another_disk::uuidGen("a");
+    const auto b = yet_another_disk::uuidGen("b");
+    yet_another_disk::StoredItems stored;
+    stored.emplace(a, yet_another_disk::StoredItem{"FOLDER", root, 100, {root, a}, 3, 2});
+    stored.emplace(b, yet_another_disk::StoredItem{"FOLDER", root, 0, {root, b}});
+    const std::vector<yet_another_disk::ImportItem> items = {
+            makeItem(R"({"id": "a", "type": "FOLDER", "parentId": "b"})"),
+            makeItem(R"({"id": "f", "type": "FILE", "parentId": "a", "url": "/f", "size": 5})"),
+    };
+    const auto deltas = yet_another_disk::collectParentDeltas(items, stored);
+    EXPECT_EQ(deltas.at(root).size, -100);
+    EXPECT_EQ(deltas.at(root).files, -3);
+    EXPECT_EQ(deltas.at(b).size, 100);
+    EXPECT_EQ(deltas.at(b).files, 3);
+    EXPECT_EQ(deltas.at(b).maxDepth, 3);
+    EXPECT_EQ(deltas.at(a).size, 5);
+    EXPECT_EQ(deltas.at(a).files, 1);
+    EXPECT_EQ(deltas.at(a).maxDepth, 1);
+}
+
+UTEST(SpreadDeltas, DepthGrowsPerLevel) {
+    const auto root = yet_another_disk::uuidGen("root");
+    const auto a = yet_another_disk::uuidGen("a");
+    const auto b = yet_another_disk::uuidGen("b");
+    const yet_another_disk::ParentMap parents = {{root, std::nullopt}, {a, root}, {b, a}};
+    yet_another_disk::FolderDeltas parentDeltas;
+    parentDeltas[b] = {5, 1, 1};
+    parentDeltas[root] = {7, 2, 1};
+    const auto deltas = yet_another_disk::spreadDeltas(parentDeltas, parents);
+    EXPECT_EQ(deltas.at(b).maxDepth, 1);
+    EXPECT_EQ(deltas.at(a).maxDepth, 2);
+    EXPECT_EQ(deltas.at(root).size, 12);
+    EXPECT_EQ(deltas.at(root).files, 3);
+    EXPECT_EQ(deltas.at(root).maxDepth, 3);
+}
+
+UTEST(BuildPaths, MoveUnderDescendant) {
+    const auto root = yet_another_disk::uuidGen("root");
+    const auto a = yet_another_disk::uuidGen("a");
+    yet_another_disk::StoredItems stored;
+    stored.emplace(a, yet_another_disk::StoredItem{"FOLDER", root, 0, {root, a}});
+    const std::vector<yet_another_disk::ImportItem> items = {
+            makeItem(R"({"id": "b", "type": "FOLDER", "parentId": "a"})"),
+    };
+    const auto paths = yet_another_disk::buildPaths(items, yet_another_disk::buildParentMap(items, stored));
+    ASSERT_TRUE(paths.has_value());
+    EXPECT_EQ(paths->at(0), (yet_another_disk::ItemPath{root, a, yet_another_disk::uuidGen("b")}));
+
+    const std::vector<yet_another_disk::ImportItem> cycle = {
+            makeItem(R"({"id": "b", "type": "FOLDER", "parentId": "a"})"),
+            makeItem(R"({"id": "a", "type": "FOLDER", "parentId": "b"})"),
+    };
+    EXPECT_FALSE(yet_another_disk::buildPaths(cycle, yet_another_disk::buildParentMap(cycle, stored)).has_value());
+}
+
+UTEST(TreeIndex, EraseSubtree) {
+    const auto root = yet_another_disk::uuidGen("root");
+    const auto a = yet_another_disk::uuidGen("a");
+    const auto f = yet_another_disk::uuidGen("f");
+    const std::string date = "2022-02-03T15:00:00+0000";
+    yet_another_disk::TreePatch build{yet_another_disk::TreeIndex{}};
+    build.Upsert(f, a, {"f", "a", "FILE", "/f", 5, date});
+    build.Upsert(a, root, {"a", "root", "FOLDER", std::nullopt, 5, date});
+    build.Upsert(root, std::nullopt, {"root", std::nullopt, "FOLDER", std::nullopt, 5, date});
+    auto index = build.Finish();
+    EXPECT_EQ(index.size, 3u);
+
+    const auto write = [&index](const boost::uuids::uuid &id, std::size_t maxDepth) {
+        yet_another_disk::SubtreeWriter writer;
+        if (!yet_another_disk::writeSubtree(index, id, {maxDepth, std::nullopt, std::nullopt}, writer))
+            return formats::json::Value{};
+        return formats::json::FromString(writer.Finish());
+    };
+
+    const auto tree = write(root, yet_another_disk::kUnlimitedDepth);
+    EXPECT_EQ(tree["children"][0]["children"][0]["id"].As<std::string>(), "f");
+    EXPECT_TRUE(write(root, 1)["children"][0]["children"].IsNull());
+    EXPECT_TRUE(write(root, 0)["children"].IsNull());
+
+    const auto before = index;
+    yet_another_disk::TreePatch erase{index};
+    erase.EraseSubtree(a);
+    index = erase.Finish();
+    EXPECT_EQ(index.size, 1u);
+    EXPECT_TRUE(write(f, yet_another_disk::kUnlimitedDepth).IsNull());
+    EXPECT_TRUE(write(root, yet_another_disk::kUnlimitedDepth)["children"].IsEmpty());
+    // The snapshot the patch started from is left as it was.
+    EXPECT_EQ(before.size, 3u);
+    EXPECT_TRUE(yet_another_disk::findNode(before, f).has_value());
+    EXPECT_EQ(yet_another_disk::nodeAt(before, *yet_another_disk::findNode(before, root)).children->size(), 1u);
+}
+
+UTEST(TreeIndex, Move) {
+    const auto root = yet_another_disk::uuidGen("root");
+    const auto a = yet_another_disk::uuidGen("a");
+    const auto b = yet_another_disk::uuidGen("b");
+    const auto f = yet_another_disk::uuidGen("f");
+    const std::string date = "2022-02-03T15:00:00+0000";
+    yet_another_disk::TreePatch build{yet_another_disk::TreeIndex{}};
+    build.Upsert(root, std::nullopt, {"root", std::nullopt, "FOLDER", std::nullopt, 5, date});
+    build.Upsert(a, root, {"a", "root", "FOLDER", std::nullopt, 5, date});
+    build.Upsert(b, root, {"b", "root", "FOLDER", std::nullopt, 0, date});
+    build.Upsert(f, a, {"f", "a", "FILE", "/f", 5, date});
+    const auto index = build.Finish();
+
+    yet_another_disk::TreePatch move{index};
+    move.Upsert(f, b, {"f", "b", "FILE", "/f", 5, date});
+    move.Upsert(a, root, {"a", "root", "FOLDER", std::nullopt, 0, date});
+    const auto moved = move.Finish();
+    const auto node = [](const yet_another_disk::TreeIndex &index, const boost::uuids::uuid &id) {
+        return yet_another_disk::nodeAt(index, *yet_another_disk::findNode(index, id));
+    };
+    EXPECT_TRUE(node(moved, a).children->empty());
+    ASSERT_EQ(node(moved, b).children->size(), 1u);
+    EXPECT_EQ(yet_another_disk::nodeAt(moved, node(moved, b).children->front()).id, f);
+    EXPECT_EQ(node(moved, a).size, 0);
+    EXPECT_EQ(yet_another_disk::viewText(moved, *yet_another_disk::findNode(moved, f), node(moved, f).parentId), "b");
+    // Untouched child lists are shared with the previous snapshot.
+    EXPECT_EQ(node(moved, root).children, node(index, root).children);
+}
+
+UTEST(SubtreeWriter, Chunks) {
+    std::string streamed;
+    yet_another_disk::SubtreeWriter writer([&streamed](std::string &&chunk) { streamed += chunk; }, 16);
+    writer.Add(0, {"root", std::nullopt, "FOLDER", std::nullopt, 3, "date"});
+    writer.Add(1, {"a\"b", "root", "FILE", "/a", 1, "date"});
+    writer.Add(1, {"c", "root", "FILE", "/c", 2, "date"});
+    EXPECT_TRUE(writer.Finish().empty());
+
+    const auto tree = formats::json::FromString(streamed);
+    EXPECT_EQ(tree["children"].GetSize(), 2u);
+    EXPECT_EQ(tree["children"][0]["id"].As<std::string>(), "a\"b");
+    EXPECT_TRUE(tree["children"][1]["children"].IsNull());
+}
+
+UTEST(TreeIndex, Pages) {
+    const auto root = yet_another_disk::uuidGen("root");
+    const std::string date = "2022-02-03T15:00:00+0000";
+    yet_another_disk::TreePatch build{yet_another_disk::TreeIndex{}};
+    build.Upsert(root, std::nullopt, {"root", std::nullopt, "FOLDER", std::nullopt, 3, date});
+    for (const std::string id: {"a", "b", "c"}) {
+        build.Upsert(yet_another_disk::uuidGen(id), root, {id, "root", "FILE", "/" + id, 1, date});
+    }
+    const auto index = build.Finish();
+
+    std::vector<std::string> seen;
+    yet_another_disk::SubtreeQuery query{yet_another_disk::kUnlimitedDepth, 2, std::nullopt};
+    while (true) {
+        yet_another_disk::SubtreeWriter writer;
+        ASSERT_TRUE(yet_another_disk::writeSubtree(index, root, query, writer));
+        const auto page = formats::json::FromString(writer.Finish());
+        for (const auto &child: page["children"]) {
+            seen.push_back(child["id"].As<std::string>());
+        }
+        if (page["next"].IsMissing())
+            break;
+        query.after = yet_another_disk::uuidGen(page["next"].As<std::string>());
+    }
+    std::sort(seen.begin(), seen.end());
+    EXPECT_EQ(seen, (std::vector<std::string>{"a", "b", "c"}));
+}
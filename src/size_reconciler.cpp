@@ -0,0 +1,155 @@
+#include "size_reconciler.hpp"
+#include "tree_cache.hpp"
+
+#include <userver/components/statistics_storage.hpp>
+#include <userver/logging/log.hpp>
+#include <userver/testsuite/testsuite_support.hpp>
+
+namespace yet_another_disk {
+
+    namespace {
+
+        // Takes the deepest level that still has a folder nobody holds, locks
+        // the rows of a batch of its dirty folders first and only then removes
+        // the marks of the rows it got, so that an import changing one of them
+        // waits for the batch to end instead of having its delta overwritten.
+        // Folders an import holds right now are skipped and keep their marks
+        // for a later batch, a shallower level goes on meanwhile: a parent
+        // checked too early is marked again when its child gets repaired.
+        // Marks of folders deleted since are dropped on the way.
+        const storages::postgres::Query kClaimBatch{"WITH level AS (\n"
+                                                    "   SELECT d.depth\n"
+                                                    "   FROM yet_another_disk.dirty_folders d\n"
+                                                    "       JOIN yet_another_disk.system_items s ON s.id = d.id\n"
+                                                    "   ORDER BY d.depth DESC\n"
+                                                    "   LIMIT 1\n"
+                                                    "   FOR UPDATE OF s SKIP LOCKED\n"
+                                                    "), locked AS (\n"
+                                                    "   SELECT s.id\n"
+                                                    "   FROM yet_another_disk.dirty_folders d\n"
+                                                    "       JOIN level USING (depth)\n"
+                                                    "       JOIN yet_another_disk.system_items s ON s.id = d.id\n"
+                                                    "   ORDER BY s.id\n"
+                                                    "   LIMIT $1\n"
+                                                    "   FOR UPDATE OF s SKIP LOCKED\n"
+                                                    "), claimed AS (\n"
+                                                    "   DELETE FROM yet_another_disk.dirty_folders d\n"
+                                                    "   USING locked l\n"
+                                                    "   WHERE d.id = l.id\n"
+                                                    "   RETURNING d.id\n"
+                                                    "), orphaned AS (\n"
+                                                    "   DELETE FROM yet_another_disk.dirty_folders d\n"
+                                                    "   WHERE NOT EXISTS (SELECT 1 FROM yet_another_disk.system_items s WHERE s.id = d.id)\n"
+                                                    ")\n"
+                                                    "SELECT id FROM claimed ORDER BY id;",
+                                                    storages::postgres::Query::Name{"claim_dirty_folders"}};
+
+        // Children are one level deeper and were checked by earlier batches,
+        // so a folder only aggregates its direct children through the
+        // (parent_id, id) index. Depth is only ever raised by deltas, this is
+        // where a folder that lost its deepest subtree gets shallower. A
+        // corrected folder gets a history row with the size it should have
+        // had at its last change.
+        const storages::postgres::Query kRepairBatch{"WITH actual AS (\n"
+                                                     "   SELECT f.id, c.size, c.files, c.max_depth\n"
+                                                     "   FROM yet_another_disk.system_items f\n"
+                                                     "       CROSS JOIN LATERAL (\n"
+                                                     "           SELECT COALESCE(sum(item_size), 0)::bigint AS size,\n"
+                                                     "                  COALESCE(sum(file_count), 0)::bigint AS files,\n"
+                                                     "                  COALESCE(max(max_depth) + 1, 0) AS max_depth\n"
+                                                     "           FROM yet_another_disk.system_items\n"
+                                                     "           WHERE parent_id = f.id) c\n"
+                                                     "   WHERE f.id = ANY($1)\n"
+                                                     "), repaired AS (\n"
+                                                     "   UPDATE yet_another_disk.system_items s\n"
+                                                     "       SET item_size = a.size, file_count = a.files, max_depth = a.max_depth\n"
+                                                     "   FROM actual a\n"
+                                                     "   WHERE s.id = a.id\n"
+                                                     "     AND (s.item_size, s.file_count, s.max_depth) IS DISTINCT FROM (a.size, a.files, a.max_depth)\n"
+                                                     "   RETURNING s.id, s.id_string, s.url, s.parent_id, s.item_type, s.item_size,\n"
+                                                     "             s.\"date-time\", s.path\n"
+                                                     "), dirtied AS (\n"
+                                                     "   INSERT INTO yet_another_disk.dirty_folders (id, depth)\n"
+                                                     "   SELECT parent_id, array_length(path, 1) - 1\n"
+                                                     "   FROM repaired\n"
+                                                     "   WHERE parent_id IS NOT NULL\n"
+                                                     "   ON CONFLICT (id) DO NOTHING\n"
+                                                     "), recorded AS (\n"
+                                                     "   INSERT INTO yet_another_disk.history\n"
+                                                     "   \t( item_id, id_string, parent_string, url, parent_id, item_type, item_size, \"date-time\")\n"
+                                                     "   SELECT r.id, r.id_string, p.id_string, r.url, r.parent_id, r.item_type, r.item_size, r.\"date-time\"\n"
+                                                     "   FROM repaired r\n"
+                                                     "       LEFT JOIN yet_another_disk.system_items p ON p.id = r.parent_id\n"
+                                                     ")\n"
+                                                     "SELECT id FROM repaired;",
+                                                     storages::postgres::Query::Name{"repair_folder_sizes"}};
+
+    }  // namespace
+
+    SizeReconciler::SizeReconciler(const components::ComponentConfig &config,
+                                   const components::ComponentContext &component_context)
+            : components::LoggableComponentBase(config, component_context),
+              pg_cluster_(
+                      component_context
+                              .FindComponent<components::Postgres>("postgres-db-1")
+                              .GetCluster()),
+              tree_cache_(component_context.FindComponent<TreeCache>()),
+              batchSize_(config["batch-size"].As<std::size_t>(1000)),
+              maxBatches_(config["max-batches"].As<std::size_t>(100)) {
+        statisticsEntry_ = component_context.FindComponent<components::StatisticsStorage>()
+                .GetStorage()
+                .RegisterExtender(std::string{kName}, [this](const auto &request) {
+                    return ExtendStatistics(request);
+                });
+
+        const auto interval = config["check-interval"].As<std::chrono::seconds>();
+        task_.Start(std::string{kName}, utils::PeriodicTask::Settings{interval}, [this] { Reconcile(); });
+        task_.RegisterInTestsuite(component_context.FindComponent<components::TestsuiteSupport>()
+                                          .GetPeriodicTaskControl());
+    }
+
+    SizeReconciler::~SizeReconciler() {
+        task_.Stop();
+        statisticsEntry_.Unregister();
+    }
+
+    std::size_t SizeReconciler::Reconcile() {
+        std::size_t corrected = 0;
+        for (std::size_t batch = 0; batch < maxBatches_; ++batch) {
+            if (ReconcileBatch(corrected) == 0)
+                break;
+        }
+        if (corrected > 0)
+            LOG_INFO() << "Repaired the aggregates of " << corrected << " folders";
+        return corrected;
+    }
+
+    std::size_t SizeReconciler::ReconcileBatch(std::size_t &corrected) {
+        auto trx = pg_cluster_->Begin(storages::postgres::TransactionOptions{});
+        const auto claimed = trx.Execute(kClaimBatch, static_cast<long long>(batchSize_))
+                .AsContainer<std::vector<boost::uuids::uuid>>();
+        if (claimed.empty()) {
+            // Keeps the orphan marks dropped by the claim.
+            trx.Commit();
+            return 0;
+        }
+        const auto repaired = trx.Execute(kRepairBatch, claimed)
+                .AsContainer<std::vector<boost::uuids::uuid>>();
+        trx.Commit();
+        // Other instances see the repair with their next incremental update.
+        tree_cache_.Refresh(repaired);
+
+        checkedRows_ += claimed.size();
+        correctedRows_ += repaired.size();
+        corrected += repaired.size();
+        return claimed.size();
+    }
+
+    formats::json::ValueBuilder SizeReconciler::ExtendStatistics(const utils::statistics::StatisticsRequest &) {
+        formats::json::ValueBuilder res;
+        res["checked-rows"] = checkedRows_.load();
+        res["corrected-rows"] = correctedRows_.load();
+        return res;
+    }
+
+}  // namespace yet_another_disk
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "handlers.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <userver/components/loggable_component_base.hpp>
+#include <userver/utils/periodic_task.hpp>
+#include <userver/utils/statistics/storage.hpp>
+
+namespace yet_another_disk {
+
+    class TreeCache;
+
+    // Checks the aggregate size, file count and depth of folders that
+    // imports and deletes changed since the last pass against their
+    // children, and repairs them. Folders are taken deepest first in batches of `batch-size`, each
+    // batch in its own short transaction, at most `max-batches` per pass. A
+    // repaired folder marks its parent, so a repair travels up to the root
+    // over the following batches. Repaired folders get a history row and
+    // are refreshed in the tree cache.
+    class SizeReconciler final : public components::LoggableComponentBase {
+    public:
+        static constexpr std::string_view kName = "size-reconciler";
+
+        SizeReconciler(const components::ComponentConfig &config,
+                       const components::ComponentContext &component_context);
+
+        ~SizeReconciler() override;
+
+        // Runs a single pass, returns the number of repaired folders.
+        std::size_t Reconcile();
+
+    private:
+        // Returns the number of folders checked, 0 once nothing is dirty.
+        std::size_t ReconcileBatch(std::size_t &corrected);
+
+        formats::json::ValueBuilder ExtendStatistics(const utils::statistics::StatisticsRequest &);
+
+        storages::postgres::ClusterPtr pg_cluster_;
+        TreeCache &tree_cache_;
+        std::size_t batchSize_;
+        std::size_t maxBatches_;
+
+        std::atomic<std::uint64_t> checkedRows_{0};
+        std::atomic<std::uint64_t> correctedRows_{0};
+
+        utils::statistics::Entry statisticsEntry_;
+        utils::PeriodicTask task_;
+    };
+
+}  // namespace yet_another_disk
@@ -0,0 +1,427 @@
+#include "tree_cache.hpp"
+#include "metrics.hpp"
+
+#include <userver/utils/scope_guard.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+
+namespace yet_another_disk {
+
+    namespace {
+
+        const storages::postgres::Query kSelectNodes{"SELECT\n"
+                                                     "\ts.id, s.parent_id, s.id_string, p.id_string, s.item_type::text, s.url,\n"
+                                                     "\ts.item_size, s.\"date-time\"\n"
+                                                     "FROM\n"
+                                                     "\tyet_another_disk.system_items s\n"
+                                                     "    LEFT JOIN yet_another_disk.system_items p ON p.id = s.parent_id;",
+                                                     storages::postgres::Query::Name{"select_nodes"}};
+
+        const storages::postgres::Query kSelectNodesByIds{"SELECT\n"
+                                                          "\ts.id, s.parent_id, s.id_string, p.id_string, s.item_type::text, s.url,\n"
+                                                          "\ts.item_size, s.\"date-time\"\n"
+                                                          "FROM\n"
+                                                          "\tyet_another_disk.system_items s\n"
+                                                          "    LEFT JOIN yet_another_disk.system_items p ON p.id = s.parent_id\n"
+                                                          "WHERE\n"
+                                                          "    s.id = ANY($1);",
+                                                          storages::postgres::Query::Name{"select_nodes_by_ids"}};
+
+        const storages::postgres::Query kSelectChangedNodes{"SELECT\n"
+                                                            "\ts.id, s.parent_id, s.id_string, p.id_string, s.item_type::text, s.url,\n"
+                                                            "\ts.item_size, s.\"date-time\"\n"
+                                                            "FROM\n"
+                                                            "\tyet_another_disk.system_items s\n"
+                                                            "    LEFT JOIN yet_another_disk.system_items p ON p.id = s.parent_id\n"
+                                                            "WHERE\n"
+                                                            "    s.changed_at > $1;",
+                                                            storages::postgres::Query::Name{"select_changed_nodes"}};
+
+        const storages::postgres::Query kSelectDeletedIds{"SELECT id FROM yet_another_disk.deleted_items WHERE deleted_at > $1;",
+                                                          storages::postgres::Query::Name{"select_deleted_ids"}};
+
+        // The uuids of a node and its parent followed by the columns of NodeRow.
+        struct IndexRow {
+            boost::uuids::uuid uuid;
+            std::optional<boost::uuids::uuid> parentUuid;
+            std::string id;
+            std::optional<std::string> parentId;
+            std::string type;
+            std::optional<std::string> url;
+            long long size;
+            storages::postgres::TimePointTz date;
+        };
+
+        TextRef storeText(NodeChunk &chunk, std::string_view value) {
+            // Offsets are 32-bit, refuse what would wrap them instead of
+            // pointing into the wrong string.
+            if (value.size() > std::numeric_limits<std::uint32_t>::max() - chunk.text.size())
+                throw std::length_error("tree cache chunk text exceeds 4 GiB");
+            TextRef ref{static_cast<std::uint32_t>(chunk.text.size()), static_cast<std::uint32_t>(value.size())};
+            chunk.text.append(value);
+            return ref;
+        }
+
+        std::string_view chunkText(const NodeChunk &chunk, TextRef ref) {
+            return std::string_view(chunk.text).substr(ref.offset, ref.length);
+        }
+
+        // Copies the chunk keeping only the strings of its live nodes, so the
+        // strings of replaced and erased nodes go away whenever a chunk is
+        // touched.
+        std::shared_ptr<NodeChunk> copyChunk(const NodeChunk &chunk) {
+            auto res = std::make_shared<NodeChunk>();
+            res->nodes = chunk.nodes;
+            for (auto &node: res->nodes) {
+                if (!node.live) {
+                    node = TreeNode{};
+                    continue;
+                }
+                for (auto *ref: {&node.idString, &node.parentId, &node.type, &node.url, &node.date}) {
+                    *ref = storeText(*res, chunkText(chunk, *ref));
+                }
+            }
+            return res;
+        }
+
+        std::size_t shardOf(const boost::uuids::uuid &id) {
+            return (static_cast<std::size_t>(id.data[0]) << 8 | id.data[1]) % TreeIndex::kShards;
+        }
+
+        void upsertRow(TreePatch &patch, const storages::postgres::Row &row) {
+            const auto node = row.As<IndexRow>(storages::postgres::kRowTag);
+            const auto date = utils::datetime::Timestring(node.date.GetUnderlying());
+            patch.Upsert(node.uuid, node.parentUuid,
+                         NodeView{node.id, node.parentId, node.type, node.url, node.size, date});
+        }
+
+    }  // namespace
+
+    std::optional<std::uint32_t> findNode(const TreeIndex &index, const boost::uuids::uuid &id) {
+        const auto &shard = index.positions[shardOf(id)];
+        if (!shard)
+            return {};
+        const auto position = shard->find(id);
+        if (position == shard->end())
+            return {};
+        return position->second;
+    }
+
+    const TreeNode &nodeAt(const TreeIndex &index, std::uint32_t position) {
+        return index.chunks[position / NodeChunk::kSize]->nodes[position % NodeChunk::kSize];
+    }
+
+    std::string_view viewText(const TreeIndex &index, std::uint32_t position, TextRef ref) {
+        return chunkText(*index.chunks[position / NodeChunk::kSize], ref);
+    }
+
+    TreePatch::TreePatch(const TreeIndex &base) : index_(base) {}
+
+    NodeChunk &TreePatch::MutableChunk(std::uint32_t position) {
+        const auto number = position / NodeChunk::kSize;
+        auto &owned = ownedChunks_[number];
+        if (!owned) {
+            if (number == index_.chunks.size()) {
+                owned = std::make_shared<NodeChunk>();
+                index_.chunks.push_back(owned);
+            } else {
+                owned = copyChunk(*index_.chunks[number]);
+                index_.chunks[number] = owned;
+            }
+        }
+        return *owned;
+    }
+
+    TreeIndex::Shard &TreePatch::MutableShard(const boost::uuids::uuid &id) {
+        const auto number = shardOf(id);
+        auto &owned = ownedShards_[number];
+        if (!owned) {
+            const auto &base = index_.positions[number];
+            owned = base ? std::make_shared<TreeIndex::Shard>(*base) : std::make_shared<TreeIndex::Shard>();
+            index_.positions[number] = owned;
+        }
+        return *owned;
+    }
+
+    void TreePatch::Upsert(const boost::uuids::uuid &id, const std::optional<boost::uuids::uuid> &parent,
+                           const NodeView &node) {
+        auto position = findNode(index_, id);
+        const bool added = !position.has_value();
+        if (added) {
+            if (index_.used == std::numeric_limits<std::uint32_t>::max())
+                throw std::length_error("tree cache exceeds 2^32 nodes");
+            position = index_.used++;
+            MutableShard(id)[id] = position.value();
+            ++index_.size;
+        }
+        auto &chunk = MutableChunk(position.value());
+        auto &res = chunk.nodes[position.value() % NodeChunk::kSize];
+        const bool moved = added || res.hasParent != parent.has_value() || res.parent != parent.value_or(boost::uuids::nil_uuid());
+        if (moved && !added && res.hasParent)
+            changes_[res.parent].removed.push_back(id);
+        if (moved && parent.has_value())
+            changes_[parent.value()].added.push_back(id);
+
+        res.id = id;
+        res.hasParent = parent.has_value();
+        res.parent = parent.value_or(boost::uuids::nil_uuid());
+        res.size = node.size;
+        res.idString = storeText(chunk, node.id);
+        res.parentId = storeText(chunk, node.parentId.value_or(std::string_view{}));
+        res.type = storeText(chunk, node.type);
+        res.hasUrl = node.url.has_value();
+        res.url = storeText(chunk, node.url.value_or(std::string_view{}));
+        res.date = storeText(chunk, node.date);
+        res.live = true;
+    }
+
+    void TreePatch::EraseSubtree(const boost::uuids::uuid &id) {
+        const auto root = findNode(index_, id);
+        if (!root.has_value())
+            return;
+        const auto &rootNode = nodeAt(index_, root.value());
+        if (rootNode.hasParent)
+            changes_[rootNode.parent].removed.push_back(id);
+        std::vector<std::uint32_t> stack = {root.value()};
+        while (!stack.empty()) {
+            const auto position = stack.back();
+            stack.pop_back();
+            auto &node = MutableChunk(position).nodes[position % NodeChunk::kSize];
+            if (!node.live)
+                continue;
+            if (node.children)
+                stack.insert(stack.end(), node.children->begin(), node.children->end());
+            MutableShard(node.id).erase(node.id);
+            node = TreeNode{};
+            --index_.size;
+        }
+    }
+
+    TreeIndex TreePatch::Finish() {
+        // Only the parents whose set of children changed get a new child
+        // list. A node may have been moved more than once by the patch, it
+        // is only added under the parent it ends up with.
+        for (auto &[parentId, change]: changes_) {
+            const auto parent = findNode(index_, parentId);
+            if (!parent.has_value())
+                continue;
+            auto children = std::make_shared<std::vector<std::uint32_t>>();
+            const auto &old = nodeAt(index_, parent.value()).children;
+            if (old) {
+                std::sort(change.removed.begin(), change.removed.end());
+                children->reserve(old->size() + change.added.size());
+                for (const auto child: *old) {
+                    const auto &node = nodeAt(index_, child);
+                    if (node.live && !std::binary_search(change.removed.begin(), change.removed.end(), node.id))
+                        children->push_back(child);
+                }
+            }
+            for (const auto &child: change.added) {
+                const auto position = findNode(index_, child);
+                if (!position.has_value())
+                    continue;
+                const auto &node = nodeAt(index_, position.value());
+                if (node.hasParent && node.parent == parentId)
+                    children->push_back(position.value());
+            }
+            std::sort(children->begin(), children->end(), [this](std::uint32_t lhs, std::uint32_t rhs) {
+                return nodeAt(index_, lhs).id < nodeAt(index_, rhs).id;
+            });
+            children->erase(std::unique(children->begin(), children->end()), children->end());
+            MutableChunk(parent.value()).nodes[parent.value() % NodeChunk::kSize].children = std::move(children);
+        }
+        changes_.clear();
+        ownedChunks_.clear();
+        ownedShards_ = {};
+        return std::move(index_);
+    }
+
+    bool writeSubtree(const TreeIndex &index, const boost::uuids::uuid &id, const SubtreeQuery &query,
+                      SubtreeWriter &writer) {
+        const auto root = findNode(index, id);
+        if (!root.has_value())
+            return false;
+
+        auto nodeView = [&index, &query](std::uint32_t position, std::size_t depth) {
+            const auto &node = nodeAt(index, position);
+            const auto &chunk = *index.chunks[position / NodeChunk::kSize];
+            std::optional<std::string_view> parentId;
+            if (node.hasParent)
+                parentId = chunkText(chunk, node.parentId);
+            std::optional<std::string_view> url;
+            if (node.hasUrl)
+                url = chunkText(chunk, node.url);
+            const bool childrenOmitted = depth == query.maxDepth && node.children && !node.children->empty();
+            return NodeView{chunkText(chunk, node.idString), parentId, chunkText(chunk, node.type),
+                            url, node.size, chunkText(chunk, node.date), childrenOmitted};
+        };
+        using Children = std::vector<std::uint32_t>;
+        static const Children kNoChildren;
+        auto childrenOf = [&index](std::uint32_t position) -> const Children & {
+            const auto &children = nodeAt(index, position).children;
+            return children ? *children : kNoChildren;
+        };
+
+        const auto &rootChildren = childrenOf(root.value());
+        auto first = rootChildren.begin();
+        auto last = rootChildren.end();
+        if (query.after.has_value()) {
+            first = std::upper_bound(first, last, query.after.value(),
+                                     [&index](const boost::uuids::uuid &after, std::uint32_t child) {
+                                         return after < nodeAt(index, child).id;
+                                     });
+        }
+        if (query.maxDepth == 0)
+            last = first;
+        if (query.limit.has_value() && static_cast<std::size_t>(last - first) > query.limit.value()) {
+            last = first + query.limit.value();
+            const auto lastChild = *(last - 1);
+            writer.SetNext(viewText(index, lastChild, nodeAt(index, lastChild).idString));
+        }
+
+        writer.Add(0, nodeView(root.value(), 0));
+        std::vector<std::pair<std::uint32_t, std::size_t>> stack;
+        for (auto child = last; child != first; --child) {
+            stack.emplace_back(*(child - 1), 1);
+        }
+        while (!stack.empty()) {
+            const auto [position, depth] = stack.back();
+            stack.pop_back();
+            writer.Add(depth, nodeView(position, depth));
+            if (depth == query.maxDepth)
+                continue;
+            const auto &children = childrenOf(position);
+            for (auto child = children.rbegin(); child != children.rend(); ++child) {
+                stack.emplace_back(*child, depth + 1);
+            }
+        }
+        return true;
+    }
+
+    TreeCache::TreeCache(const components::ComponentConfig &config,
+                         const components::ComponentContext &component_context)
+            : components::CachingComponentBase<TreeIndex>(config, component_context),
+              pg_cluster_(
+                      component_context
+                              .FindComponent<components::Postgres>("postgres-db-1")
+                              .GetCluster()),
+              overlap_(config["incremental-overlap"].As<std::chrono::seconds>(30)) {
+        StartPeriodicUpdates();
+    }
+
+    TreeCache::~TreeCache() {
+        StopPeriodicUpdates();
+    }
+
+    bool TreeCache::WriteSubtree(const std::string &id, const SubtreeQuery &query, SubtreeWriter &writer) const {
+        // The snapshot stays alive until the whole subtree is written out.
+        const auto index = Get();
+        return writeSubtree(*index, uuidGen(id), query, writer);
+    }
+
+    void TreeCache::Refresh(const std::vector<boost::uuids::uuid> &ids) {
+        if (ids.empty())
+            return;
+        std::lock_guard lock(mutex_);
+        if (reloading_)
+            pendingRefresh_.insert(pendingRefresh_.end(), ids.begin(), ids.end());
+        RefreshLocked(ids);
+    }
+
+    void TreeCache::EraseSubtree(const std::string &id) {
+        std::lock_guard lock(mutex_);
+        if (reloading_)
+            pendingErase_.push_back(id);
+        EraseSubtreeLocked(id);
+    }
+
+    void TreeCache::Update(cache::UpdateType type,
+                           const std::chrono::system_clock::time_point &last_update,
+                           const std::chrono::system_clock::time_point &,
+                           cache::UpdateStatisticsScope &stats_scope) {
+        {
+            std::lock_guard lock(mutex_);
+            reloading_ = true;
+        }
+        // A failed update leaves the pending patches for the next one, the
+        // patches apply directly meanwhile. Runs after the lock below is
+        // released.
+        const utils::ScopeGuard reloaded([this] {
+            std::lock_guard lock(mutex_);
+            reloading_ = false;
+        });
+        // Read from the master: a lagging replica could hand back rows older
+        // than patches that were applied before this update started.
+        std::unique_ptr<TreeIndex> index;
+        std::vector<boost::uuids::uuid> deleted;
+        std::optional<storages::postgres::ResultSet> changed;
+        if (type == cache::UpdateType::kFull) {
+            const auto rows = pg_cluster_->Execute(storages::postgres::ClusterHostType::kMaster, kSelectNodes);
+            stats_scope.IncreaseDocumentsReadCount(rows.Size());
+            TreePatch patch{TreeIndex{}};
+            for (const auto &row: rows) {
+                upsertRow(patch, row);
+            }
+            index = std::make_unique<TreeIndex>(patch.Finish());
+        } else {
+            // changed_at is the start of the writing transaction, which may
+            // commit after the previous update has read. The overlap covers
+            // such transactions and the clock difference with the database.
+            const storages::postgres::TimePointTz since{last_update - overlap_};
+            deleted = pg_cluster_->Execute(storages::postgres::ClusterHostType::kMaster, kSelectDeletedIds, since)
+                    .AsContainer<std::vector<boost::uuids::uuid>>();
+            changed = pg_cluster_->Execute(storages::postgres::ClusterHostType::kMaster, kSelectChangedNodes, since);
+            stats_scope.IncreaseDocumentsReadCount(deleted.size() + changed->Size());
+        }
+
+        std::lock_guard lock(mutex_);
+        if (!index) {
+            // Deletes go first: an id deleted and imported again within the
+            // window is back in system_items and is upserted after.
+            TreePatch patch{*Get()};
+            for (const auto &id: deleted) {
+                patch.EraseSubtree(id);
+            }
+            for (const auto &row: *changed) {
+                upsertRow(patch, row);
+            }
+            index = std::make_unique<TreeIndex>(patch.Finish());
+        }
+        const auto size = index->size;
+        Set(std::move(index));
+        reloading_ = false;
+        const auto pendingRefresh = std::move(pendingRefresh_);
+        const auto pendingErase = std::move(pendingErase_);
+        pendingRefresh_.clear();
+        pendingErase_.clear();
+        for (const auto &id: pendingErase) {
+            EraseSubtreeLocked(id);
+        }
+        if (!pendingRefresh.empty())
+            RefreshLocked(pendingRefresh);
+        stats_scope.Finish(size);
+    }
+
+    void TreeCache::RefreshLocked(const std::vector<boost::uuids::uuid> &ids) {
+        static auto &queryTime = metrics().Query("select_nodes_by_ids");
+        const auto rows = [&] {
+            const QueryTimer timer(queryTime);
+            return pg_cluster_->Execute(storages::postgres::ClusterHostType::kMaster, kSelectNodesByIds, ids);
+        }();
+        TreePatch patch{*Get()};
+        for (const auto &row: rows) {
+            upsertRow(patch, row);
+        }
+        Set(std::make_unique<TreeIndex>(patch.Finish()));
+    }
+
+    void TreeCache::EraseSubtreeLocked(const std::string &id) {
+        TreePatch patch{*Get()};
+        patch.EraseSubtree(uuidGen(id));
+        Set(std::make_unique<TreeIndex>(patch.Finish()));
+    }
+
+}  // namespace yet_another_disk
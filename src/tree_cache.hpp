@@ -0,0 +1,151 @@
+#pragma once
+
+#include "handlers.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include <userver/cache/caching_component_base.hpp>
+#include <userver/engine/mutex.hpp>
+
+namespace yet_another_disk {
+
+    // Reference to a string kept in NodeChunk::text.
+    struct TextRef {
+        std::uint32_t offset = 0;
+        std::uint32_t length = 0;
+    };
+
+    struct TreeNode {
+        boost::uuids::uuid id;
+        boost::uuids::uuid parent;
+        long long size = 0;
+        TextRef idString;
+        TextRef parentId;
+        TextRef type;
+        TextRef url;
+        TextRef date;
+        bool hasParent = false;
+        bool hasUrl = false;
+        // Erased nodes keep their slot until the next full reload.
+        bool live = false;
+        // Positions of the children in ascending uuid order, so that pages of
+        // children are found by binary search. Shared with older snapshots
+        // until the node gains or loses a child.
+        std::shared_ptr<const std::vector<std::uint32_t>> children;
+    };
+
+    // A fixed block of node slots and the strings of its nodes back to back.
+    struct NodeChunk {
+        static constexpr std::size_t kSize = 256;
+
+        std::array<TreeNode, kSize> nodes;
+        std::string text;
+    };
+
+    // Flat snapshot of the tree. Nodes live in an array of chunks and refer
+    // to their children by position, only the requested node is looked up
+    // by its 16-byte uuid. A change copies only the chunks, position shards
+    // and child lists it touches and shares everything else with the
+    // snapshot it was made from, so readers holding the old snapshot are not
+    // disturbed and a patch costs the size of what it changes rather than
+    // the size of the tree.
+    struct TreeIndex {
+        static constexpr std::size_t kShards = 1024;
+        using Shard = std::unordered_map<boost::uuids::uuid, std::uint32_t, UuidHash>;
+
+        std::vector<std::shared_ptr<const NodeChunk>> chunks;
+        std::array<std::shared_ptr<const Shard>, kShards> positions;
+        // Slots handed out, live or erased.
+        std::uint32_t used = 0;
+        // Live nodes.
+        std::size_t size = 0;
+    };
+
+    std::optional<std::uint32_t> findNode(const TreeIndex &index, const boost::uuids::uuid &id);
+
+    const TreeNode &nodeAt(const TreeIndex &index, std::uint32_t position);
+
+    std::string_view viewText(const TreeIndex &index, std::uint32_t position, TextRef ref);
+
+    // Builds the next snapshot from a base one. Nodes are linked to their
+    // parents in Finish, so a patch may add children before their parent.
+    class TreePatch {
+    public:
+        explicit TreePatch(const TreeIndex &base);
+
+        // Adds the node or replaces it, keeping its children.
+        void Upsert(const boost::uuids::uuid &id, const std::optional<boost::uuids::uuid> &parent,
+                    const NodeView &node);
+
+        void EraseSubtree(const boost::uuids::uuid &id);
+
+        TreeIndex Finish();
+
+    private:
+        struct ChildChanges {
+            std::vector<boost::uuids::uuid> added;
+            std::vector<boost::uuids::uuid> removed;
+        };
+
+        NodeChunk &MutableChunk(std::uint32_t position);
+
+        TreeIndex::Shard &MutableShard(const boost::uuids::uuid &id);
+
+        TreeIndex index_;
+        // Chunks and shards already copied by this patch.
+        std::unordered_map<std::size_t, std::shared_ptr<NodeChunk>> ownedChunks_;
+        std::array<std::shared_ptr<TreeIndex::Shard>, TreeIndex::kShards> ownedShards_;
+        std::unordered_map<boost::uuids::uuid, ChildChanges, UuidHash> changes_;
+    };
+
+    bool writeSubtree(const TreeIndex &index, const boost::uuids::uuid &id, const SubtreeQuery &query,
+                      SubtreeWriter &writer);
+
+    // In-memory copy of system_items for GET /nodes. Every update interval it
+    // reads only the rows changed and the subtrees deleted since the previous
+    // update, going back `incremental-overlap` further. The full reload runs
+    // on the much longer full update interval as a safety net. Imports and
+    // Delete patch it right after they commit, so this instance never serves
+    // its own writes stale.
+    class TreeCache final : public components::CachingComponentBase<TreeIndex> {
+    public:
+        static constexpr std::string_view kName = "tree-cache";
+
+        TreeCache(const components::ComponentConfig &config,
+                  const components::ComponentContext &component_context);
+
+        ~TreeCache() override;
+
+        // Returns false without writing anything if the item is not cached.
+        bool WriteSubtree(const std::string &id, const SubtreeQuery &query, SubtreeWriter &writer) const;
+
+        // Re-reads the given rows and links them to their current parents.
+        void Refresh(const std::vector<boost::uuids::uuid> &ids);
+
+        void EraseSubtree(const std::string &id);
+
+    private:
+        void Update(cache::UpdateType type,
+                    const std::chrono::system_clock::time_point &last_update,
+                    const std::chrono::system_clock::time_point &now,
+                    cache::UpdateStatisticsScope &stats_scope) override;
+
+        void RefreshLocked(const std::vector<boost::uuids::uuid> &ids);
+
+        void EraseSubtreeLocked(const std::string &id);
+
+        storages::postgres::ClusterPtr pg_cluster_;
+        std::chrono::seconds overlap_;
+
+        // Serializes patches with each other and with the end of a reload.
+        engine::Mutex mutex_;
+        // Patches made while a reload is reading are replayed on top of it.
+        bool reloading_ = false;
+        std::vector<boost::uuids::uuid> pendingRefresh_;
+        std::vector<std::string> pendingErase_;
+    };
+
+}  // namespace yet_another_disk
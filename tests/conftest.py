@@ -38,3 +38,34 @@ def pgsql_local(root_dir, pgsql_local_create):
 @pytest.fixture
 def client_deps(pgsql):
     pass
+
+
+def pytest_addoption(parser):
+    group = parser.getgroup('perf')
+    group.addoption('--perf', action='store_true',
+                    help='Run the load tests marked with perf')
+    group.addoption('--perf-fanout', type=int, default=4)
+    group.addoption('--perf-depth', type=int, default=4)
+    group.addoption('--perf-files', type=int, default=8,
+                    help='Files in every folder of the generated tree')
+    group.addoption('--perf-rps', type=float, default=100)
+    group.addoption('--perf-duration', type=float, default=30,
+                    help='Seconds of mixed load')
+    group.addoption('--perf-report', help='Write the report as JSON here')
+    group.addoption('--perf-baseline',
+                    help='Fail on regressions against this report')
+    group.addoption('--perf-tolerance', type=float, default=0.2)
+
+
+def pytest_collection_modifyitems(config, items):
+    if config.getoption('--perf'):
+        return
+    skip = pytest.mark.skip(reason='load tests run with --perf')
+    for item in items:
+        if 'perf' in item.keywords:
+            item.add_marker(skip)
+
+
+@pytest.fixture
+def perf_options(pytestconfig):
+    return pytestconfig.option
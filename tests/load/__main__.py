@@ -0,0 +1,99 @@
+"""Load test of a running service.
+
+Start the service with its PostgreSQL, e.g. `make docker-start-service`,
+then run from the repository root:
+
+    python3 -m tests.load --url http://localhost:8080 --rps 200 \
+        --duration 60 --report report.json
+
+Pass a previous report as --baseline to fail on regressions.
+"""
+
+import argparse
+import asyncio
+import json
+import sys
+import time
+
+import aiohttp
+
+from . import dataset
+from . import workload
+
+
+class HttpClient:
+    """The part of the testsuite service_client interface the workload
+    uses, over a plain aiohttp session."""
+
+    def __init__(self, session, url):
+        self._session = session
+        self._url = url.rstrip('/')
+
+    async def get(self, path, **kwargs):
+        return await self._request('GET', path, **kwargs)
+
+    async def post(self, path, **kwargs):
+        return await self._request('POST', path, **kwargs)
+
+    async def delete(self, path, **kwargs):
+        return await self._request('DELETE', path, **kwargs)
+
+    async def _request(self, method, path, **kwargs):
+        async with self._session.request(
+                method, self._url + path, **kwargs) as response:
+            await response.read()
+            return response
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--url', default='http://localhost:8080')
+    parser.add_argument('--fanout', type=int, default=4)
+    parser.add_argument('--depth', type=int, default=4)
+    parser.add_argument('--files', type=int, default=8,
+                        help='files in every folder')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--rps', type=float, default=100)
+    parser.add_argument('--duration', type=float, default=30,
+                        help='seconds')
+    parser.add_argument('--mix', type=workload.parse_mix,
+                        default=workload.DEFAULT_MIX,
+                        help='weights, e.g. import=2,nodes=7,delete=1')
+    parser.add_argument('--report', help='write the report as JSON here')
+    parser.add_argument('--baseline', help='report to compare against')
+    parser.add_argument('--tolerance', type=float, default=0.2)
+    return parser.parse_args()
+
+
+async def main(args):
+    tree = dataset.make_tree(args.fanout, args.depth, args.files,
+                             seed=args.seed)
+    connector = aiohttp.TCPConnector(limit=0)
+    async with aiohttp.ClientSession(connector=connector) as session:
+        client = HttpClient(session, args.url)
+        start = time.monotonic()
+        imported = await dataset.import_tree(client, tree)
+        elapsed = time.monotonic() - start
+        print(f'Imported {imported} items in {len(tree.batches)} batches, '
+              f'{imported / elapsed:.0f} items/s')
+        report = await workload.run(client, tree, rps=args.rps,
+                                    duration=args.duration, mix=args.mix,
+                                    seed=args.seed)
+    print(workload.format_report(report))
+
+    if args.report:
+        with open(args.report, 'w') as output:
+            json.dump(report, output, indent=2)
+    if args.baseline:
+        with open(args.baseline) as baseline:
+            regressions = workload.compare(report, json.load(baseline),
+                                           args.tolerance)
+        for regression in regressions:
+            print(f'Regression: {regression}')
+        if regressions:
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(asyncio.run(main(parse_args())))
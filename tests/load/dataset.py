@@ -0,0 +1,91 @@
+"""Synthetic trees for load tests, written through /imports."""
+
+import dataclasses
+import datetime
+import random
+import uuid
+
+# /imports takes the date in the body, /delete as a query argument.
+BODY_DATE_FORMAT = '%Y-%m-%dT%H:%M:%S+0000'
+ARG_DATE_FORMAT = '%Y-%m-%dT%H:%M:%S.000Z'
+
+MAX_FILE_SIZE = 1 << 30
+
+
+@dataclasses.dataclass
+class Tree:
+    root_id: str
+    # Folder ids, parents before their children.
+    folders: list
+    # File id -> parent folder id.
+    files: dict
+    # /imports bodies creating the whole tree, in order.
+    batches: list
+
+
+def now():
+    return datetime.datetime.now(datetime.timezone.utc)
+
+
+def make_tree(fanout, depth, files_per_folder, *, seed=0, batch_size=1000,
+              date=None):
+    """Tree of `depth` levels of folders below the root, each with `fanout`
+    subfolders, and `files_per_folder` files in every folder. File sizes are
+    log-normal, most files are small and a few are large. The same seed
+    gives the same ids and sizes."""
+    rng = random.Random(seed)
+    update_date = (date or now()).strftime(BODY_DATE_FORMAT)
+
+    def new_id():
+        return str(uuid.UUID(int=rng.getrandbits(128), version=4))
+
+    root_id = new_id()
+    items = [folder_item(root_id, None)]
+    folders = [root_id]
+    level = [root_id]
+    for _ in range(depth):
+        next_level = []
+        for parent_id in level:
+            for _ in range(fanout):
+                folder_id = new_id()
+                items.append(folder_item(folder_id, parent_id))
+                next_level.append(folder_id)
+        folders.extend(next_level)
+        level = next_level
+
+    files = {}
+    for folder_id in folders:
+        for _ in range(files_per_folder):
+            file_id = new_id()
+            items.append(file_item(file_id, folder_id, file_size(rng)))
+            files[file_id] = folder_id
+
+    batches = [{'items': items[start:start + batch_size],
+                'updateDate': update_date}
+               for start in range(0, len(items), batch_size)]
+    return Tree(root_id, folders, files, batches)
+
+
+def folder_item(folder_id, parent_id):
+    return {'type': 'FOLDER', 'id': folder_id, 'parentId': parent_id}
+
+
+def file_item(file_id, parent_id, size):
+    return {'type': 'FILE', 'id': file_id, 'parentId': parent_id,
+            'url': f'/file/{file_id}', 'size': size}
+
+
+def file_size(rng):
+    return max(1, min(MAX_FILE_SIZE, int(rng.lognormvariate(10, 2))))
+
+
+async def import_tree(client, tree):
+    """Writes the tree batch by batch, returns the number of items."""
+    imported = 0
+    for batch in tree.batches:
+        response = await client.post('/imports', json=batch)
+        if response.status != 200:
+            raise RuntimeError(
+                f'Import of the dataset failed with {response.status}')
+        imported += len(batch['items'])
+    return imported
@@ -0,0 +1,182 @@
+"""Open-loop mixed workload over a tree made by dataset.make_tree."""
+
+import asyncio
+import collections
+import random
+import time
+
+from . import dataset
+
+ENDPOINTS = ('import', 'nodes', 'delete')
+DEFAULT_MIX = {'import': 2, 'nodes': 7, 'delete': 1}
+# Share of file imports that move the file to another folder.
+MOVE_SHARE = 0.3
+
+
+def parse_mix(value):
+    """'import=2,nodes=7,delete=1' -> {'import': 2, 'nodes': 7, ...}"""
+    mix = {}
+    for part in value.split(','):
+        name, _, weight = part.partition('=')
+        if name not in ENDPOINTS:
+            raise ValueError(f'Unknown endpoint {name!r} in the mix')
+        mix[name] = float(weight)
+    return mix
+
+
+def percentile(ordered, share):
+    if not ordered:
+        return 0.0
+    index = min(len(ordered) - 1, int(share * len(ordered)))
+    return ordered[index]
+
+
+class Stats:
+    def __init__(self):
+        self.latencies = collections.defaultdict(list)
+        self.errors = collections.Counter()
+
+    def account(self, endpoint, latency, ok):
+        self.latencies[endpoint].append(latency)
+        if not ok:
+            self.errors[endpoint] += 1
+
+    def report(self, elapsed):
+        endpoints = {}
+        for endpoint, latencies in sorted(self.latencies.items()):
+            ordered = sorted(latencies)
+            endpoints[endpoint] = {
+                'requests': len(ordered),
+                'errors': self.errors[endpoint],
+                'rps': len(ordered) / elapsed if elapsed else 0.0,
+                'p50_ms': percentile(ordered, 0.50) * 1000,
+                'p90_ms': percentile(ordered, 0.90) * 1000,
+                'p99_ms': percentile(ordered, 0.99) * 1000,
+                'max_ms': ordered[-1] * 1000,
+            }
+        return {'elapsed_s': elapsed, 'endpoints': endpoints}
+
+
+class Workload:
+    """Picks the target of every request and keeps track of which files
+    are deleted, so that deletes always hit an existing file and imports
+    bring deleted files back. Folders are never deleted, so every import
+    stays valid."""
+
+    def __init__(self, client, tree, rng):
+        self._client = client
+        self._tree = tree
+        self._rng = rng
+        self._live = list(tree.files)
+        self._deleted = []
+
+    async def do_import(self):
+        # A file in flight is in neither list, so no other request can
+        # delete it in the meantime.
+        if self._deleted and self._rng.random() < 0.5:
+            source = self._deleted
+        elif self._live:
+            source = self._live
+        else:
+            return await self.do_nodes()
+        file_id = source.pop(self._rng.randrange(len(source)))
+        parent_id = self._tree.files[file_id]
+        if self._rng.random() < MOVE_SHARE:
+            parent_id = self._rng.choice(self._tree.folders)
+        response = await self._client.post('/imports', json={
+            'items': [dataset.file_item(
+                file_id, parent_id, dataset.file_size(self._rng))],
+            'updateDate': dataset.now().strftime(dataset.BODY_DATE_FORMAT),
+        })
+        if response.status == 200:
+            self._tree.files[file_id] = parent_id
+            self._live.append(file_id)
+        else:
+            source.append(file_id)
+        return response.status == 200
+
+    async def do_nodes(self):
+        folder_id = self._rng.choice(self._tree.folders)
+        response = await self._client.get(f'/nodes/{folder_id}')
+        return response.status == 200
+
+    async def do_delete(self):
+        if not self._live:
+            return await self.do_nodes()
+        file_id = self._live.pop(self._rng.randrange(len(self._live)))
+        response = await self._client.delete(
+            f'/delete/{file_id}',
+            params={'date': dataset.now().strftime(dataset.ARG_DATE_FORMAT)})
+        if response.status == 200:
+            self._deleted.append(file_id)
+        else:
+            self._live.append(file_id)
+        return response.status == 200
+
+
+async def run(client, tree, *, rps, duration, mix=None, seed=0):
+    """Sends requests at a fixed rate for `duration` seconds whatever the
+    response times are. Latency counts from the moment a request was due,
+    so a stalled service shows up in the percentiles instead of lowering
+    the request rate."""
+    mix = mix or DEFAULT_MIX
+    rng = random.Random(seed)
+    workload = Workload(client, tree, rng)
+    actions = {'import': workload.do_import,
+               'nodes': workload.do_nodes,
+               'delete': workload.do_delete}
+    names = [name for name in ENDPOINTS if mix.get(name)]
+    weights = [mix[name] for name in names]
+    stats = Stats()
+
+    async def send(endpoint, due):
+        try:
+            ok = await actions[endpoint]()
+        except Exception:
+            ok = False
+        stats.account(endpoint, time.monotonic() - due, ok)
+
+    start = time.monotonic()
+    tasks = []
+    for index in range(int(rps * duration)):
+        due = start + index / rps
+        delay = due - time.monotonic()
+        if delay > 0:
+            await asyncio.sleep(delay)
+        endpoint = rng.choices(names, weights)[0]
+        tasks.append(asyncio.ensure_future(send(endpoint, due)))
+    await asyncio.gather(*tasks)
+    return stats.report(time.monotonic() - start)
+
+
+def compare(report, baseline, tolerance):
+    """Regressions of `report` against `baseline`: latency percentiles
+    more than `tolerance` (0.2 is 20%) above the baseline, throughput below
+    it, or errors where the baseline had none."""
+    regressions = []
+    for endpoint, base in baseline['endpoints'].items():
+        current = report['endpoints'].get(endpoint)
+        if current is None:
+            continue
+        for key in ('p50_ms', 'p90_ms', 'p99_ms'):
+            if current[key] > base[key] * (1 + tolerance):
+                regressions.append(
+                    f'{endpoint} {key}: {current[key]:.1f} '
+                    f'> {base[key]:.1f}')
+        if current['rps'] < base['rps'] * (1 - tolerance):
+            regressions.append(
+                f'{endpoint} rps: {current["rps"]:.1f} < {base["rps"]:.1f}')
+        if current['errors'] and not base['errors']:
+            regressions.append(f'{endpoint} errors: {current["errors"]}')
+    return regressions
+
+
+def format_report(report):
+    lines = [f'{"endpoint":<10}{"requests":>10}{"errors":>8}{"rps":>9}'
+             f'{"p50 ms":>9}{"p90 ms":>9}{"p99 ms":>9}{"max ms":>9}']
+    for endpoint, row in report['endpoints'].items():
+        lines.append(
+            f'{endpoint:<10}{row["requests"]:>10}{row["errors"]:>8}'
+            f'{row["rps"]:>9.1f}{row["p50_ms"]:>9.1f}{row["p90_ms"]:>9.1f}'
+            f'{row["p99_ms"]:>9.1f}{row["max_ms"]:>9.1f}')
+    return '\n'.join(lines)
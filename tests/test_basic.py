@@ -1,3 +1,4 @@
+import asyncio
 import pytest
 import json
 import re
@@ -230,3 +231,390 @@ async def test_db_initial_data(service_client):
         f"Expected HTTP status code 200, got {response.status}"
     assert json_response == EXPECTED_TREE, \
         "Expected tree doesn't match result of imports/nodes"
+
+
+async def test_imports_move(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    response = await service_client.post("/imports", json={
+        "items": [
+            {
+                "type": "FILE",
+                "url": "/file/url1",
+                "id": "863e1a7a-1304-42ae-943b-179184c077e3",
+                "parentId": "1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2",
+                "size": 128
+            }
+        ],
+        "updateDate": "2022-02-04T12:00:00+0000"
+    })
+    assert response.status == 200
+
+    response = await service_client.get(f"/nodes/{ROOT_ID}")
+    assert response.status == 200
+    json_response = json.loads(response.text)
+    sizes = {child["id"]: child["size"]
+             for child in json_response["children"]}
+    assert json_response["size"] == 1984
+    assert sizes["d515e43f-f3f6-4471-bb77-6b455017a2d2"] == 256
+    assert sizes["1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2"] == 1728
+
+
+async def test_nodes_depth(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    # Folders at the depth limit have children that are not listed.
+    for params in ({"depth": "1"}, {"depth": "1", "consistency": "strong"}):
+        response = await service_client.get(f"/nodes/{ROOT_ID}",
+                                            params=params)
+        assert response.status == 200
+        json_response = json.loads(response.text)
+        assert json_response["size"] == 1984
+        assert len(json_response["children"]) == 2
+        for child in json_response["children"]:
+            assert child["children"] is None
+
+    response = await service_client.get(f"/nodes/{ROOT_ID}",
+                                        params={"depth": "-1"})
+    assert response.status == 400
+
+
+async def test_nodes_pages(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    folder_id = "1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2"
+    seen = []
+    params = {"depth": "1", "limit": "2"}
+    while True:
+        response = await service_client.get(f"/nodes/{folder_id}",
+                                            params=params)
+        assert response.status == 200
+        json_response = json.loads(response.text)
+        assert json_response["size"] == 1600
+        assert len(json_response["children"]) <= 2
+        seen.extend(child["id"] for child in json_response["children"])
+        if "next" not in json_response:
+            break
+        params["after"] = json_response["next"]
+
+    assert sorted(seen) == sorted([
+        "98883e8f-0507-482f-bce2-2fb306cf6483",
+        "74b81fda-9cdc-4b63-8927-c978afed5cf4",
+        "73bc3b36-02d1-4245-ab35-3106c9ee1c65",
+    ])
+
+
+async def test_nodes_strong_consistency(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    response = await service_client.get(f"/nodes/{ROOT_ID}",
+                                        params={"consistency": "strong"})
+    assert response.status == 200
+    json_response = json.loads(response.text)
+    deep_sort_children(json_response)
+    deep_sort_children(EXPECTED_TREE)
+    assert json_response == EXPECTED_TREE
+
+    response = await service_client.get(f"/nodes/{ROOT_ID}/stats",
+                                        params={"consistency": "strong"})
+    assert response.status == 200
+    assert json.loads(response.text)["size"] == 1984
+
+    response = await service_client.get(
+        "/updates", params={"date": "2022-02-03T15:00:00.000Z",
+                            "consistency": "strong"})
+    assert response.status == 200
+    assert len(json.loads(response.text)["items"]) == 3
+
+    response = await service_client.get(f"/node/{ROOT_ID}/history",
+                                        params={"consistency": "strong"})
+    assert response.status == 200
+    assert json.loads(response.text)["items"]
+
+
+async def test_updates(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    response = await service_client.get(
+        "/updates", params={"date": "2022-02-03T15:00:00.000Z"})
+    assert response.status == 200
+    items = json.loads(response.text)["items"]
+    assert sorted(item["id"] for item in items) == sorted([
+        "98883e8f-0507-482f-bce2-2fb306cf6483",
+        "74b81fda-9cdc-4b63-8927-c978afed5cf4",
+        "73bc3b36-02d1-4245-ab35-3106c9ee1c65",
+    ])
+    sizes = {item["id"]: item["size"] for item in items}
+    assert sizes["73bc3b36-02d1-4245-ab35-3106c9ee1c65"] == 64
+
+    response = await service_client.get("/updates",
+                                        params={"date": "yesterday"})
+    assert response.status == 400
+
+
+async def test_node_history(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    folder_id = "1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2"
+    # An empty folder deepens its ancestors but leaves their size alone,
+    # they get no history row for it.
+    response = await service_client.post("/imports", json={
+        "items": [
+            {
+                "type": "FOLDER",
+                "id": "5d1a2f3e-7c4b-4e8a-9f60-1b2c3d4e5f60",
+                "parentId": folder_id
+            }
+        ],
+        "updateDate": "2022-02-04T12:00:00+0000"
+    })
+    assert response.status == 200
+
+    response = await service_client.get(f"/node/{folder_id}/history")
+    assert response.status == 200
+    items = json.loads(response.text)["items"]
+    assert [item["size"] for item in items] == [1536, 1600]
+
+    response = await service_client.get(
+        f"/node/{folder_id}/history",
+        params={"dateStart": "2022-02-03T00:00:00.000Z",
+                "dateEnd": "2022-02-03T15:00:00.000Z"})
+    assert response.status == 200
+    items = json.loads(response.text)["items"]
+    assert len(items) == 1
+    assert items[0]["size"] == 1536
+    assert items[0]["type"] == "FOLDER"
+    assert items[0]["date"] == "2022-02-03T12:00:00+0000"
+
+    response = await service_client.get(
+        "/node/00000000-0000-0000-0000-000000000000/history")
+    assert response.status == 404
+
+
+async def test_delete_updates_ancestors(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    response = await service_client.delete(
+        "/delete/d515e43f-f3f6-4471-bb77-6b455017a2d2",
+        params={"date": "2022-02-04T12:00:00.000Z"})
+    assert response.status == 200
+
+    response = await service_client.get(f"/nodes/{ROOT_ID}",
+                                        params={"consistency": "strong"})
+    assert response.status == 200
+    json_response = json.loads(response.text)
+    assert json_response["size"] == 1600
+    assert json_response["date"] == "2022-02-04T12:00:00+0000"
+    assert len(json_response["children"]) == 1
+
+    response = await service_client.get(
+        "/node/863e1a7a-1304-42ae-943b-179184c077e3/history")
+    assert response.status == 404
+
+
+async def test_imports_concurrent(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    # Files moved back and forth between both folders at once, every
+    # import locks the root and both folders.
+    folders = ["d515e43f-f3f6-4471-bb77-6b455017a2d2",
+               "1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2"]
+    files = ["863e1a7a-1304-42ae-943b-179184c077e3",
+             "b1d8fd7d-2ae3-47d5-b2f9-0f094af800d4"]
+
+    def move(index):
+        return service_client.post("/imports", json={
+            "items": [
+                {
+                    "type": "FILE",
+                    "url": f"/file/concurrent{index}",
+                    "id": file_id,
+                    "parentId": folders[(index + offset) % 2],
+                    "size": 128
+                }
+                for offset, file_id in enumerate(files)
+            ],
+            "updateDate": "2022-02-04T12:00:00+0000"
+        })
+
+    responses = await asyncio.gather(*(move(index) for index in range(16)))
+    assert all(response.status == 200 for response in responses)
+
+    response = await service_client.get(f"/nodes/{ROOT_ID}",
+                                        params={"consistency": "strong"})
+    assert response.status == 200
+    json_response = json.loads(response.text)
+    sizes = [child["size"] for child in json_response["children"]]
+    assert json_response["size"] == sum(sizes)
+
+
+async def test_size_reconciler(service_client, pgsql):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    folder_id = "1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2"
+    cursor = pgsql['db-1'].cursor()
+    cursor.execute(
+        "UPDATE yet_another_disk.system_items SET item_size = 1 "
+        f"WHERE id_string = '{folder_id}'")
+    cursor.execute(
+        "INSERT INTO yet_another_disk.dirty_folders (id, depth) "
+        "SELECT id, array_length(path, 1) "
+        "FROM yet_another_disk.system_items "
+        f"WHERE id_string = '{folder_id}' "
+        "ON CONFLICT (id) DO NOTHING")
+
+    def history_rows():
+        cursor.execute(
+            "SELECT count(*) FROM yet_another_disk.history h "
+            "JOIN yet_another_disk.system_items s ON s.id = h.item_id "
+            f"WHERE s.id_string = '{folder_id}'")
+        return cursor.fetchone()[0]
+
+    rows_before = history_rows()
+    await service_client.run_periodic_task('size-reconciler')
+
+    response = await service_client.get(f"/nodes/{folder_id}",
+                                        params={"consistency": "strong"})
+    assert response.status == 200
+    assert json.loads(response.text)["size"] == 1600
+
+    cursor.execute("SELECT count(*) FROM yet_another_disk.dirty_folders")
+    assert cursor.fetchone()[0] == 0
+    assert history_rows() == rows_before + 1
+
+
+async def test_size_reconciler_after_delete(service_client, pgsql):
+    folder_id = "d515e43f-f3f6-4471-bb77-6b455017a2d2"
+    for batch in IMPORT_BATCHES[:2]:
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    # The import marks the folder and the root, the folder is gone before
+    # the next pass. A mark left behind by anything else is dropped too.
+    response = await service_client.delete(
+        f"/delete/{folder_id}", params={"date": "2022-02-03T12:00:00.000Z"})
+    assert response.status == 200
+    cursor = pgsql['db-1'].cursor()
+    cursor.execute(
+        "UPDATE yet_another_disk.system_items SET item_size = 1 "
+        f"WHERE id_string = '{ROOT_ID}'")
+    cursor.execute(
+        "INSERT INTO yet_another_disk.dirty_folders (id, depth) "
+        "VALUES ('00000000-0000-0000-0000-000000000000', 10)")
+
+    await service_client.run_periodic_task('size-reconciler')
+
+    response = await service_client.get(f"/nodes/{ROOT_ID}",
+                                        params={"consistency": "strong"})
+    assert response.status == 200
+    assert json.loads(response.text)["size"] == 0
+
+    cursor.execute("SELECT count(*) FROM yet_another_disk.dirty_folders")
+    assert cursor.fetchone()[0] == 0
+
+
+async def test_node_stats(service_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    first_id = "d515e43f-f3f6-4471-bb77-6b455017a2d2"
+    second_id = "1cc0129a-2bfe-474c-9ee6-d435bf5fc8f2"
+
+    async def stats(item_id):
+        response = await service_client.get(f"/nodes/{item_id}/stats")
+        assert response.status == 200
+        json_response = json.loads(response.text)
+        return (json_response["size"], json_response["fileCount"],
+                json_response["maxDepth"], json_response["lastModified"])
+
+    assert await stats(ROOT_ID) == (1984, 5, 2, "2022-02-03T15:00:00+0000")
+    assert await stats("863e1a7a-1304-42ae-943b-179184c077e3") == \
+        (128, 1, 0, "2022-02-02T12:00:00+0000")
+
+    # Moving the second folder under the first deepens both ancestors.
+    response = await service_client.post("/imports", json={
+        "items": [
+            {"type": "FOLDER", "id": second_id, "parentId": first_id}
+        ],
+        "updateDate": "2022-02-04T12:00:00+0000"
+    })
+    assert response.status == 200
+    assert await stats(first_id) == (1984, 5, 2, "2022-02-04T12:00:00+0000")
+    assert await stats(ROOT_ID) == (1984, 5, 3, "2022-02-04T12:00:00+0000")
+
+    # Moving it back only gets the first folder shallower once it is
+    # recounted.
+    response = await service_client.post("/imports", json={
+        "items": [
+            {"type": "FOLDER", "id": second_id, "parentId": ROOT_ID}
+        ],
+        "updateDate": "2022-02-05T12:00:00+0000"
+    })
+    assert response.status == 200
+    assert (await stats(first_id))[:2] == (384, 2)
+    await service_client.run_periodic_task('size-reconciler')
+    assert await stats(first_id) == (384, 2, 1, "2022-02-05T12:00:00+0000")
+    assert await stats(ROOT_ID) == (1984, 5, 2, "2022-02-05T12:00:00+0000")
+
+    response = await service_client.delete(
+        f"/delete/{second_id}", params={"date": "2022-02-06T12:00:00.000Z"})
+    assert response.status == 200
+    assert await stats(ROOT_ID) == (384, 2, 2, "2022-02-06T12:00:00+0000")
+
+    response = await service_client.get(f"/nodes/{second_id}/stats")
+    assert response.status == 404
+
+
+async def test_imports_bulk(service_client):
+    lines = [json.dumps(item)
+             for batch in IMPORT_BATCHES for item in batch["items"]]
+    response = await service_client.post(
+        "/imports/bulk", data="\n".join(lines) + "\n",
+        params={"updateDate": "2022-02-03T15:00:00.000Z"})
+    assert response.status == 200
+    assert json.loads(response.text)["imported"] == len(lines)
+
+    response = await service_client.get(f"/nodes/{ROOT_ID}",
+                                        params={"consistency": "strong"})
+    assert response.status == 200
+    json_response = json.loads(response.text)
+    assert json_response["size"] == 1984
+    assert len(json_response["children"]) == 2
+
+    response = await service_client.post(
+        "/imports/bulk", data='{"id": "broken"\n',
+        params={"updateDate": "2022-02-03T15:00:00.000Z"})
+    assert response.status == 400
+    assert json.loads(response.text)["imported"] == 0
+
+
+async def test_metrics(service_client, monitor_client):
+    for index, batch in enumerate(IMPORT_BATCHES):
+        response = await service_client.post("/imports", json=batch)
+        assert response.status == 200
+
+    response = await monitor_client.get(
+        "/service/monitor", params={"prefix": "yet-another-disk"})
+    assert response.status == 200
+    metrics = json.loads(response.text)["yet-another-disk"]
+    assert "handler-imports" in metrics["handlers"]
+    assert "insert_items" in metrics["queries"]
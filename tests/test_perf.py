@@ -0,0 +1,47 @@
+import json
+
+import pytest
+
+from tests.load import dataset
+from tests.load import workload
+
+
+async def test_load_smoke(service_client):
+    tree = dataset.make_tree(2, 2, 2, batch_size=5)
+    assert await dataset.import_tree(service_client, tree) == 21
+
+    report = await workload.run(service_client, tree, rps=50, duration=1)
+    assert set(report['endpoints']) <= set(workload.ENDPOINTS)
+    for endpoint, row in report['endpoints'].items():
+        assert row['errors'] == 0, endpoint
+
+    response = await service_client.get(
+        f'/nodes/{tree.root_id}',
+        params={'depth': '1', 'consistency': 'strong'})
+    assert response.status == 200
+    root = json.loads(response.text)
+    assert root['size'] == sum(child['size'] for child in root['children'])
+
+
+@pytest.mark.perf
+async def test_perf(service_client, perf_options):
+    tree = dataset.make_tree(perf_options.perf_fanout,
+                             perf_options.perf_depth,
+                             perf_options.perf_files)
+    await dataset.import_tree(service_client, tree)
+
+    report = await workload.run(service_client, tree,
+                                rps=perf_options.perf_rps,
+                                duration=perf_options.perf_duration)
+    print(workload.format_report(report))
+    if perf_options.perf_report:
+        with open(perf_options.perf_report, 'w') as output:
+            json.dump(report, output, indent=2)
+    for endpoint, row in report['endpoints'].items():
+        assert row['errors'] == 0, endpoint
+
+    if perf_options.perf_baseline:
+        with open(perf_options.perf_baseline) as baseline:
+            regressions = workload.compare(report, json.load(baseline),
+                                           perf_options.perf_tolerance)
+        assert not regressions, '\n'.join(regressions)